@@ -1,23 +1,90 @@
 #include "bitrle.h"
 #include <cassert>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 //
 //
 //
 
 BitRleTable::BitRleTable()
-: m_minB(0), m_maxB(0), m_minRepeats(0), m_maxRepeats(0), m_valueLength(0), m_repeatsLength(0)
+: m_format(BitRlePairs), m_minB(0), m_maxB(0), m_minRepeats(0), m_maxRepeats(0), m_valueLength(0), m_repeatsLength(0)
+, m_minRun(0), m_countLength(0), m_literalLength(0)
 {}
 
 BitRleTable::BitRleTable(unsigned char minB, unsigned int maxB, unsigned int minRepeats, unsigned char maxRepeats)
-: m_minB(minB), m_maxB(maxB), m_minRepeats(minRepeats), m_maxRepeats(maxRepeats)
+: m_format(BitRlePairs), m_minB(minB), m_maxB(maxB), m_minRepeats(minRepeats), m_maxRepeats(maxRepeats)
 , m_valueLength(CountBits(maxB - minB))
 , m_repeatsLength(CountBits(maxRepeats - minRepeats))
+, m_minRun(0), m_countLength(0), m_literalLength(0)
 {
     assert(minB <= maxB);
     assert(minRepeats <= maxRepeats);
 }
 
+BitRleTable::BitRleTable(unsigned char minB, unsigned char maxB, unsigned char minRun, unsigned char countLength, unsigned char literalLength)
+: m_format(BitRleSpans), m_minB(minB), m_maxB(maxB), m_minRepeats(0), m_maxRepeats(0)
+, m_valueLength(CountBits(maxB - minB))
+, m_repeatsLength(0)
+, m_minRun(minRun), m_countLength(countLength), m_literalLength(literalLength)
+{
+    assert(minB <= maxB);
+    assert(0 != minRun);
+    assert(countLength <= BitRleMaxCountLength && literalLength <= BitRleMaxLiteralLength);
+}
+
+//
+// Runs are found by comparing 32 (AVX2) or 16 (SSE2) bytes at once with the value of the run,
+// the mask of the compare tells where the first other byte is.
+//
+
+// Index of the first byte from pos on that is not b, size if there is none
+static inline size_t FindRunEnd(const unsigned char* data, size_t pos, size_t size, unsigned char b)
+{
+    // most runs of text are a single byte
+    if (pos < size && data[pos] != b)
+        return pos;
+    
+#if defined(__AVX2__)
+    const __m256i b32 = _mm256_set1_epi8(static_cast<char>(b));
+    for (; pos + 32 <= size; pos += 32)
+    {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        const uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, b32)));
+        if (0xFFFFFFFFu != mask)
+            return pos + __builtin_ctz(~mask);
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i b16 = _mm_set1_epi8(static_cast<char>(b));
+    for (; pos + 16 <= size; pos += 16)
+    {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        const uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, b16)));
+        if (0xFFFFu != mask)
+            return pos + __builtin_ctz(~mask);
+    }
+#endif
+    // the words of the byte differ from the run where their xor has a bit
+    const uint64_t b8 = 0x0101010101010101ull * b;
+    for (; pos + 8 <= size; pos += 8)
+    {
+        const uint64_t diff = LoadLE64(data + pos) ^ b8;
+        if (0 != diff)
+            return pos + (__builtin_ctzll(diff) >> 3);
+    }
+    
+    while (pos < size && data[pos] == b)
+        ++pos;
+    return pos;
+}
+
 //
 //
 //
@@ -31,6 +98,7 @@ BitRleScanner::BitRleScanner()
 , m_maxRepeats(0)
 , m_minB(0)
 , m_maxB(0)
+, m_run(0)
 {
 }
 
@@ -47,6 +115,14 @@ void BitRleScanner::BeginScan()
     m_maxRepeats = 0;
     m_minB = 0;
     m_maxB = 0;
+    
+    m_run = 0;
+    std::fill(m_runs, m_runs + BitRleExactRuns, 0);
+    std::fill(m_longRuns, m_longRuns + 65, 0);
+    std::fill(&m_spans[0][0], &m_spans[0][0] + BitRleMinRuns * BitRleExactRuns, 0);
+    std::fill(m_literals, m_literals + BitRleMinRuns, 0);
+    std::fill(&m_pieces[0][0], &m_pieces[0][0] + BitRleMinRuns * (BitRleMaxLiteralLength + 1), 0);
+    std::fill(m_span, m_span + BitRleMinRuns, 0);
 }
 
 void BitRleScanner::Scan(unsigned char b)
@@ -58,6 +134,7 @@ void BitRleScanner::Scan(unsigned char b)
         m_b = b;
         m_repeats = 1;
         m_minB = m_maxB = b;
+        m_run = 1;
     }
     else
     {
@@ -75,23 +152,177 @@ void BitRleScanner::Scan(unsigned char b)
             {
                 m_repeats += 1;
             }
+            ++m_run;
         }
         else
         {
-            if (m_b < m_minB) m_minB = m_b;
-            else if (m_maxB < m_b) m_maxB = m_b;
-            
-            if (m_repeats < m_minRepeats) m_minRepeats = m_repeats;
-            else if (m_maxRepeats < m_repeats) m_maxRepeats = m_repeats;
+            EndRun();
+            EndSpansRun();
             
             m_b = b;
             m_repeats = 1;
-            ++m_cnt;
+            m_run = 1;
         }
     }
 }
 
-void BitRleScanner::EndScan(BitRleTable& table, unsigned int& totalLen)
+void BitRleScanner::Scan(const unsigned char* data, size_t size)
+{
+    assert(state_scanning == m_state);
+    assert(nullptr != data || 0 == size);
+    
+    size_t i = 0;
+    if (0 != m_repeats)
+    {
+        i = FindRunEnd(data, 0, size, m_b);
+        AddRepeats(i);
+    }
+    else if (0 != size)
+    {
+        m_minB = m_maxB = data[0];
+    }
+    
+    while (i < size)
+    {
+        if (0 != m_repeats)
+        {
+            EndRun();
+            EndSpansRun();
+        }
+        
+        m_b = data[i];
+        m_repeats = 0;
+        m_run = 0;
+        
+        const size_t end = FindRunEnd(data, i + 1, size, m_b);
+        AddRepeats(end - i);
+        i = end;
+    }
+}
+
+// Counts the run that ends at a byte of another value
+inline void BitRleScanner::EndRun()
+{
+    if (m_b < m_minB) m_minB = m_b;
+    else if (m_maxB < m_b) m_maxB = m_b;
+    
+    if (m_repeats < m_minRepeats) m_minRepeats = m_repeats;
+    if (m_maxRepeats < m_repeats) m_maxRepeats = m_repeats;
+    
+    ++m_cnt;
+}
+
+// Counts the run for BitRleSpans, a run shorter than minRun goes into the current span of literals
+inline void BitRleScanner::EndSpansRun()
+{
+    const uint64_t run = m_run;
+    if (run < BitRleExactRuns)
+        ++m_runs[run];
+    else
+        ++m_longRuns[CountBits64(run)];
+    
+    for (unsigned int t = 0; t < BitRleMinRuns; ++t)
+    {
+        if (run < (BitRleMinMinRun + t))
+            m_span[t] += run;
+        else if (0 != m_span[t])
+            EndSpan(t);
+    }
+}
+
+// Counts the span of literals of minRun BitRleMinMinRun + t
+inline void BitRleScanner::EndSpan(unsigned int t)
+{
+    const uint64_t span = m_span[t];
+    if (span < BitRleExactRuns)
+    {
+        ++m_spans[t][span];
+    }
+    else
+    {
+        m_literals[t] += span;
+        for (unsigned int lb = 0; lb <= BitRleMaxLiteralLength; ++lb)
+        {
+            m_pieces[t][lb] += (span + (static_cast<uint64_t>(1) << lb) - 1) >> lb;
+        }
+    }
+    m_span[t] = 0;
+}
+
+// Bits of BitRleSpans with the parameters that take the fewest, their table goes to table
+uint64_t BitRleScanner::GetSpansLength(unsigned char valueLength, BitRleTable& table) const
+{
+    uint64_t best = UINT64_MAX;
+    for (unsigned int t = 0; t < BitRleMinRuns; ++t)
+    {
+        const unsigned int minRun = BitRleMinMinRun + t;
+        
+        uint64_t literals = m_literals[t];
+        for (uint64_t span = 1; span < BitRleExactRuns; ++span)
+        {
+            literals += m_spans[t][span] * span;
+        }
+        
+        unsigned int literalLength = 0;
+        uint64_t literalsLen = UINT64_MAX;
+        for (unsigned int lb = 0; lb <= BitRleMaxLiteralLength; ++lb)
+        {
+            uint64_t pieces = m_pieces[t][lb];
+            for (uint64_t span = 1; span < BitRleExactRuns; ++span)
+            {
+                pieces += m_spans[t][span] * ((span + (static_cast<uint64_t>(1) << lb) - 1) >> lb);
+            }
+            
+            const uint64_t len = pieces * (1 + lb) + literals * valueLength;
+            if (len < literalsLen)
+            {
+                literalsLen = len;
+                literalLength = lb;
+            }
+        }
+        
+        for (unsigned int k = 0; k <= BitRleMaxCountLength; ++k)
+        {
+            const uint64_t escape = (1u << k) - 1;
+            const unsigned int runLen = 1 + valueLength + k;
+            
+            uint64_t len = literalsLen;
+            for (uint64_t run = minRun; run < BitRleExactRuns; ++run)
+            {
+                len += m_runs[run] * (runLen + (((run - minRun) < escape) ? 0 : BitRleLongRunBits + CountBits64(run)));
+            }
+            for (unsigned int n = 0; n <= 64; ++n)
+            {
+                len += m_longRuns[n] * (runLen + BitRleLongRunBits + n);
+            }
+            
+            if (len < best)
+            {
+                best = len;
+                table = BitRleTable(m_minB, m_maxB, minRun, k, literalLength);
+            }
+        }
+    }
+    return best;
+}
+
+// Adds count bytes to the run, a run of 255 bytes is counted and the next byte starts another one
+inline void BitRleScanner::AddRepeats(size_t count)
+{
+    m_run += count;
+    
+    size_t repeats = m_repeats + count;
+    if (repeats > 255)
+    {
+        const size_t full = (repeats - 1) / 255;
+        m_maxRepeats = 255;
+        m_cnt += full;
+        repeats -= 255 * full;
+    }
+    m_repeats = static_cast<unsigned char>(repeats);
+}
+
+void BitRleScanner::EndScan(BitRleTable& table, uint64_t& totalLen)
 {
     assert(state_scanning == m_state);
     
@@ -108,10 +339,25 @@ void BitRleScanner::EndScan(BitRleTable& table, unsigned int& totalLen)
         else if (m_maxB < m_b) m_maxB = m_b;
         
         if (m_repeats < m_minRepeats) m_minRepeats = m_repeats;
-        else if (m_maxRepeats < m_repeats) m_maxRepeats = m_repeats;
+        if (m_maxRepeats < m_repeats) m_maxRepeats = m_repeats;
         
         table = BitRleTable(m_minB, m_maxB, m_minRepeats, m_maxRepeats);
         totalLen = m_cnt * (table.GetValueLength() + table.GetRepeatsLength());
+        
+        EndSpansRun();
+        for (unsigned int t = 0; t < BitRleMinRuns; ++t)
+        {
+            if (0 != m_span[t])
+                EndSpan(t);
+        }
+        
+        BitRleTable spansTable;
+        const uint64_t spansLen = GetSpansLength(table.GetValueLength(), spansTable);
+        if (spansLen < totalLen)
+        {
+            table = spansTable;
+            totalLen = spansLen;
+        }
     }
     
     m_state = state_none;
@@ -125,19 +371,19 @@ BitRleCompressor::BitRleCompressor(const BitRleTable& table)
 : m_state(state_none)
 , m_minB(table.GetMinValue())
 , m_minRepeats(table.GetMinRepeats())
-, m_lengthB(table.GetValueLength())
-, m_lengthRepeats(table.GetRepeatsLength())
 , m_b(0)
 , m_repeats(0)
+, m_countCodes(0)
 {
 }
 
-void BitRleCompressor::BeginCompress(std::function<void(const CodeLength& b, const CodeLength& repeats)> sink)
+void BitRleCompressor::BeginCompress(std::function<void(const BitRleCode* codes, size_t count)> sink)
 {
     assert(state_none == m_state);
 
     m_b = 0;
     m_repeats = 0;
+    m_countCodes = 0;
     m_sink = sink;
 
     m_state = state_compressing;
@@ -178,6 +424,32 @@ void BitRleCompressor::Compress(unsigned char b)
     }
 }
 
+void BitRleCompressor::Compress(const unsigned char* data, size_t size)
+{
+    assert(state_compressing == m_state);
+    assert(nullptr != data || 0 == size);
+    
+    size_t i = 0;
+    if (0 != m_repeats)
+    {
+        i = FindRunEnd(data, 0, size, m_b);
+        AddRepeats(i);
+    }
+    
+    while (i < size)
+    {
+        if (0 != m_repeats)
+            Notify();
+        
+        m_b = data[i];
+        m_repeats = 0;
+        
+        const size_t end = FindRunEnd(data, i + 1, size, m_b);
+        AddRepeats(end - i);
+        i = end;
+    }
+}
+
 void BitRleCompressor::EndCompress()
 {
     assert(state_compressing == m_state);
@@ -187,12 +459,139 @@ void BitRleCompressor::EndCompress()
         Notify();
     }
     
+    if (0 != m_countCodes)
+    {
+        m_sink(m_codes, m_countCodes);
+        m_countCodes = 0;
+    }
+    
     m_state = state_none;
 }
 
-void BitRleCompressor::Notify()
+inline void BitRleCompressor::Notify()
+{
+    BitRleCode& code = m_codes[m_countCodes];
+    code.value = static_cast<unsigned char>(m_b - m_minB);
+    code.repeats = static_cast<unsigned char>(m_repeats - m_minRepeats);
+    
+    if (BitRleBatchSize == ++m_countCodes)
+    {
+        m_sink(m_codes, m_countCodes);
+        m_countCodes = 0;
+    }
+}
+
+// Adds count bytes to the run, a run of 255 bytes is coded and the next byte starts another one
+inline void BitRleCompressor::AddRepeats(size_t count)
 {
-    CodeLength cb(m_b - m_minB, m_lengthB);
-    CodeLength cr(m_repeats - m_minRepeats, m_lengthRepeats);
-    m_sink(cb, cr);
+    size_t repeats = m_repeats + count;
+    for (; repeats > 255; repeats -= 255)
+    {
+        m_repeats = 255;
+        Notify();
+    }
+    m_repeats = static_cast<unsigned char>(repeats);
+}
+
+//
+//
+//
+
+BitRleSpansCompressor::BitRleSpansCompressor(const BitRleTable& table)
+: m_state(state_none)
+, m_minB(table.GetMinValue())
+, m_minRun(table.GetMinRun())
+, m_maxLiterals(static_cast<size_t>(1) << table.GetLiteralLength())
+, m_b(0)
+, m_run(0)
+, m_countLiterals(0)
+{
+    assert(BitRleSpans == table.GetFormat());
+}
+
+void BitRleSpansCompressor::BeginCompress(std::function<void(const BitRleSpan& span)> sink)
+{
+    assert(state_none == m_state);
+    
+    m_b = 0;
+    m_run = 0;
+    m_countLiterals = 0;
+    m_sink = sink;
+    
+    m_state = state_compressing;
+}
+
+void BitRleSpansCompressor::Compress(const unsigned char* data, size_t size)
+{
+    assert(state_compressing == m_state);
+    assert(nullptr != data || 0 == size);
+    
+    size_t i = 0;
+    if (0 != m_run)
+    {
+        i = FindRunEnd(data, 0, size, m_b);
+        m_run += i;
+    }
+    
+    while (i < size)
+    {
+        if (0 != m_run)
+            EndRun();
+        
+        m_b = data[i];
+        const size_t end = FindRunEnd(data, i + 1, size, m_b);
+        m_run = end - i;
+        i = end;
+    }
+}
+
+void BitRleSpansCompressor::EndCompress()
+{
+    assert(state_compressing == m_state);
+    
+    if (0 != m_run)
+        EndRun();
+    FlushLiterals();
+    
+    m_run = 0;
+    m_state = state_none;
+}
+
+// A run of minRun bytes at least ends the span of literals before it, a shorter one goes into it
+inline void BitRleSpansCompressor::EndRun()
+{
+    const unsigned char code = static_cast<unsigned char>(m_b - m_minB);
+    
+    if (m_run >= m_minRun)
+    {
+        FlushLiterals();
+        
+        BitRleSpan span;
+        span.literals = nullptr;
+        span.length = m_run;
+        span.value = code;
+        m_sink(span);
+        return;
+    }
+    
+    for (uint64_t k = 0; k < m_run; ++k)
+    {
+        m_literals[m_countLiterals++] = code;
+        if (m_countLiterals == m_maxLiterals)
+            FlushLiterals();
+    }
+}
+
+inline void BitRleSpansCompressor::FlushLiterals()
+{
+    if (0 == m_countLiterals)
+        return;
+    
+    BitRleSpan span;
+    span.literals = m_literals;
+    span.length = m_countLiterals;
+    span.value = 0;
+    m_sink(span);
+    
+    m_countLiterals = 0;
 }
@@ -1,11 +1,25 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <functional>
 #include "common.h"
 
 //
+// Formats of a block: BitRlePairs codes every run as its value and its repeats, runs longer than 255 are
+// split. BitRleSpans codes a run of minRun bytes at least as a flag bit 1, its value and its length, shorter
+// runs are merged into spans of literal values, each a flag bit 0, its count and its values.
+// The length of a run minus minRun takes countLength bits, all ones escapes to BitRleLongRunBits bits of the bit
+// count of the length minus 1 and the length itself. The count of a span minus 1 takes literalLength bits,
+// longer spans are split.
 //
-//
+
+enum BitRleFormat { BitRlePairs, BitRleSpans };
+
+// limits of the parameters of BitRleSpans that the scanner tries
+enum { BitRleMinMinRun = 2, BitRleMaxMinRun = 4, BitRleMaxCountLength = 8, BitRleMaxLiteralLength = 8 };
+
+enum { BitRleLongRunBits = 6 };
 
 class BitRleTable
 {
@@ -13,6 +27,10 @@ public:
     BitRleTable();
     BitRleTable(unsigned char minB, unsigned int maxB, unsigned int minRepeats, unsigned char maxRepeats);
 
+    // Table of the BitRleSpans format
+    BitRleTable(unsigned char minB, unsigned char maxB, unsigned char minRun, unsigned char countLength, unsigned char literalLength);
+    
+    BitRleFormat GetFormat() const { return m_format; }
     unsigned char GetMinValue() const { return m_minB; }
     unsigned char GetMaxValue() const { return m_maxB; }
     unsigned char GetMinRepeats() const { return m_minRepeats; }
@@ -20,13 +38,21 @@ public:
     unsigned char GetValueLength() const { return m_valueLength; }
     unsigned char GetRepeatsLength() const { return m_repeatsLength; }
     
+    unsigned char GetMinRun() const { return m_minRun; }
+    unsigned char GetCountLength() const { return m_countLength; }
+    unsigned char GetLiteralLength() const { return m_literalLength; }
+    
 private:
+    BitRleFormat m_format;
     unsigned char m_minB;
     unsigned char m_maxB;
     unsigned char m_minRepeats;
     unsigned char m_maxRepeats;
     unsigned char m_valueLength;
     unsigned char m_repeatsLength;
+    unsigned char m_minRun;
+    unsigned char m_countLength;
+    unsigned char m_literalLength;
 };
 
 //
@@ -40,16 +66,28 @@ public:
     
     void BeginScan();
     void Scan(unsigned char b);
-    void EndScan(BitRleTable& table, unsigned int& totalLen);
+    
+    // Same as Scan of each byte, whole runs are found at once
+    void Scan(const unsigned char* data, size_t size);
+    
+    // Table of the format and parameters that take the fewest bits
+    void EndScan(BitRleTable& table, uint64_t& totalLen);
     
 private:
     BitRleScanner(const BitRleScanner&);
     BitRleScanner& operator=(const BitRleScanner&);
     
+    void EndRun();
+    void EndSpansRun();
+    void EndSpan(unsigned int t);
+    void AddRepeats(size_t count);
+    
+    uint64_t GetSpansLength(unsigned char valueLength, BitRleTable& table) const;
+    
     enum State { state_none, state_scanning };
     State m_state;
     
-    unsigned int m_cnt;
+    uint64_t m_cnt;
     unsigned char m_b;
     unsigned char m_repeats;
     
@@ -57,19 +95,46 @@ private:
     unsigned char m_maxRepeats;
     unsigned char m_minB;
     unsigned char m_maxB;
+    
+    // Counts of BitRleSpans: runs by length below BitRleExactRuns and by bit count above, and for each minRun
+    // spans of literals by length below BitRleExactRuns, the literal bytes and the pieces for each literalLength
+    // of longer ones, and the literals of the current span
+    enum { BitRleExactRuns = 512, BitRleMinRuns = BitRleMaxMinRun - BitRleMinMinRun + 1 };
+    
+    uint64_t m_run;
+    uint64_t m_runs[BitRleExactRuns];
+    uint64_t m_longRuns[65];
+    uint64_t m_spans[BitRleMinRuns][BitRleExactRuns];
+    uint64_t m_literals[BitRleMinRuns];
+    uint64_t m_pieces[BitRleMinRuns][BitRleMaxLiteralLength + 1];
+    uint64_t m_span[BitRleMinRuns];
 };
 
 //
 //
 //
 
+// Code of a run: its value minus the smallest value and its repeats minus the fewest repeats of a table
+struct BitRleCode
+{
+    unsigned char value;
+    unsigned char repeats;
+};
+
+// codes are handed to the sink in batches of BitRleBatchSize codes at most
+enum { BitRleBatchSize = 256 };
+
 class BitRleCompressor
 {
 public:
     BitRleCompressor(const BitRleTable& table);
     
-    void BeginCompress(std::function<void(const CodeLength& b, const CodeLength& repeats)> sink);
+    void BeginCompress(std::function<void(const BitRleCode* codes, size_t count)> sink);
     void Compress(unsigned char b);
+    
+    // Same as Compress of each byte, whole runs are found at once
+    void Compress(const unsigned char* data, size_t size);
+    
     void EndCompress();
     
 private:
@@ -77,17 +142,63 @@ private:
     BitRleCompressor& operator=(const BitRleCompressor&);
     
     void Notify();
+    void AddRepeats(size_t count);
     
     enum State { state_none, state_compressing };
     State m_state;
 
     const unsigned char m_minB;
     const unsigned char m_minRepeats;
-    const unsigned char m_lengthB;
-    const unsigned char m_lengthRepeats;
     
     unsigned char m_b;
     unsigned char m_repeats;
     
-    std::function<void(const CodeLength& b, const CodeLength& repeats)> m_sink;
+    BitRleCode m_codes[BitRleBatchSize];
+    size_t m_countCodes;
+    
+    std::function<void(const BitRleCode* codes, size_t count)> m_sink;
+};
+
+//
+//
+//
+
+// Token of BitRleSpans: a run of length bytes of the value code, or a span of length literal codes
+struct BitRleSpan
+{
+    const unsigned char* literals;  // nullptr for a run
+    uint64_t length;
+    unsigned char value;
+};
+
+class BitRleSpansCompressor
+{
+public:
+    BitRleSpansCompressor(const BitRleTable& table);
+    
+    void BeginCompress(std::function<void(const BitRleSpan& span)> sink);
+    void Compress(const unsigned char* data, size_t size);
+    void EndCompress();
+    
+private:
+    BitRleSpansCompressor(const BitRleSpansCompressor&);
+    BitRleSpansCompressor& operator=(const BitRleSpansCompressor&);
+    
+    void EndRun();
+    void FlushLiterals();
+    
+    enum State { state_none, state_compressing };
+    State m_state;
+    
+    const unsigned char m_minB;
+    const unsigned char m_minRun;
+    const size_t m_maxLiterals;
+    
+    unsigned char m_b;
+    uint64_t m_run;
+    
+    unsigned char m_literals[1 << BitRleMaxLiteralLength];
+    size_t m_countLiterals;
+    
+    std::function<void(const BitRleSpan& span)> m_sink;
 };
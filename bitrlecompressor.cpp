@@ -2,7 +2,19 @@
 #include "bitrle.h"
 #include "bitstream.h"
 #include "streamimpl.h"
+#include "format.h"
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+
+// version 3 has blocks of BitRlePairs, version 4 adds blocks of BitRleSpans
+enum { BitRleBlocksFormatVersion = 3, BitRleFormatVersion = 4 };
+
+// "more" bytes of the blocks
+enum { BitRlePairsBlock = 1, BitRleSpansBlock = 2 };
+
+// output is decoded into windows of OutputWindowSize bytes, runs are filled by words past their end
+enum { OutputWindowSize = 1 << 20, BitRleFillPadding = 16 };
 
 inline void check_true(bool expr)
 {
@@ -22,6 +34,14 @@ static void CompressBitRleTable(BitStreamWriter& w, const BitRleTable& table)
     check_true( w.WriteBits(maxRepeats) );
 }
 
+static BitRleTable MakeBitRleTable(unsigned char minValue, unsigned char maxValue, unsigned char minRepeats, unsigned char maxRepeats)
+{
+    check_true( minValue <= maxValue );
+    check_true( minRepeats <= maxRepeats );
+    
+    return BitRleTable(minValue, maxValue, minRepeats, maxRepeats);
+}
+
 static BitRleTable DecompressBitRleTable(BitStreamReader& r)
 {
     unsigned char minValue = 0;
@@ -34,87 +54,498 @@ static BitRleTable DecompressBitRleTable(BitStreamReader& r)
     check_true( r.ReadBits(&minRepeats) );
     check_true( r.ReadBits(&maxRepeats) );
     
+    return MakeBitRleTable(minValue, maxValue, minRepeats, maxRepeats);
+}
+
+// legacy streams start with the table, head holds its 4 bytes
+static BitRleTable DecompressLegacyBitRleTable(uint32_t head)
+{
+    return MakeBitRleTable(head & 0xFF, (head >> 8) & 0xFF, (head >> 16) & 0xFF, (head >> 24) & 0xFF);
+}
+
+// Table of BitRleSpans: the smallest and largest value, minRun, countLength and literalLength
+static void CompressBitRleSpansTable(BitStreamWriter& w, const BitRleTable& table)
+{
+    const unsigned char minValue = table.GetMinValue();
+    const unsigned char maxValue = table.GetMaxValue();
+    const unsigned char minRun = table.GetMinRun();
+    const unsigned char countLength = table.GetCountLength();
+    const unsigned char literalLength = table.GetLiteralLength();
+    
+    check_true( w.WriteBits(minValue) );
+    check_true( w.WriteBits(maxValue) );
+    check_true( w.WriteBits(minRun) );
+    check_true( w.WriteBits(countLength) );
+    check_true( w.WriteBits(literalLength) );
+}
+
+static BitRleTable DecompressBitRleSpansTable(BitStreamReader& r)
+{
+    unsigned char minValue = 0;
+    unsigned char maxValue = 0;
+    unsigned char minRun = 0;
+    unsigned char countLength = 0;
+    unsigned char literalLength = 0;
+    
+    check_true( r.ReadBits(&minValue) );
+    check_true( r.ReadBits(&maxValue) );
+    check_true( r.ReadBits(&minRun) );
+    check_true( r.ReadBits(&countLength) );
+    check_true( r.ReadBits(&literalLength) );
+    
     check_true( minValue <= maxValue );
-    check_true( minRepeats <= maxRepeats );
+    check_true( 0 != minRun );
+    check_true( countLength <= BitRleMaxCountLength && literalLength <= BitRleMaxLiteralLength );
     
-    return BitRleTable(minValue, maxValue, minRepeats, maxRepeats);
+    return BitRleTable(minValue, maxValue, minRun, countLength, literalLength);
 }
 
-void BitRle::Compress(IReadStream& source, ISequentialWriteStream& dest)
+// Block header: non-zero "more" byte of the format, table and payload bit count, a zero byte ends the stream.
+// A block of BitRleSpans also holds its size, a run of a damaged block can not go past it.
+static void CompressBitRleBlockHeader(BitStreamWriter& w, const BitRleTable& table, uint64_t size, uint64_t cntBits)
 {
-    BitRleTable table;
-    unsigned int cntBits = 0;
+    if (BitRlePairs == table.GetFormat())
+    {
+        const unsigned char more = BitRlePairsBlock;
+        check_true( w.WriteBits(more) );
+        CompressBitRleTable(w, table);
+    }
+    else
+    {
+        const unsigned char more = BitRleSpansBlock;
+        check_true( w.WriteBits(more) );
+        CompressBitRleSpansTable(w, table);
+    }
     
-    check_true( source.Seek(0) );
+    check_true( w.WriteBits(cntBits) );
+    if (BitRleSpans == table.GetFormat())
+        check_true( w.WriteBits(size) );
+}
+
+// Compresses a block of size bytes in the format of its table, forEachSpan passes the spans of the block to a function
+template <typename ForEachSpanF>
+static void CompressBitRleBlock(BitStreamWriter& w, const BitRleTable& table, uint64_t size, uint64_t cntBits, ForEachSpanF forEachSpan)
+{
+    CompressBitRleBlockHeader(w, table, size, cntBits);
+    
+    const unsigned int valueLength = table.GetValueLength();
     
+    if (BitRlePairs == table.GetFormat())
     {
-        BitRleScanner scanner;
-        scanner.BeginScan();
-        for (unsigned char b = 0; sizeof(b) == source.Read(&b, sizeof(b));)
+        // a run is a single field of both lengths, the compressor's Notify flushes batches of
+        // BitRleBatchSize runs to the sink, which packs them with the kernel of that width
+        const PackBitsFunction pack = GetPackBits(valueLength + table.GetRepeatsLength());
+        uint32_t runs[BitRleBatchSize];
+        
+        BitRleCompressor compressor(table);
+        compressor.BeginCompress([&](const BitRleCode* codes, size_t count)
         {
-            scanner.Scan(b);
-        }
-        scanner.EndScan(table, cntBits);
+            assert(count <= BitRleBatchSize);
+            for (size_t i = 0; i < count; ++i)
+            {
+                runs[i] = codes[i].value | (static_cast<uint32_t>(codes[i].repeats) << valueLength);
+            }
+            pack(w, runs, count);
+        });
+        forEachSpan([&](const unsigned char* data, size_t n)
+        {
+            compressor.Compress(data, n);
+        });
+        compressor.EndCompress();
+    }
+    else
+    {
+        const unsigned int minRun = table.GetMinRun();
+        const unsigned int countLength = table.GetCountLength();
+        const unsigned int literalLength = table.GetLiteralLength();
+        const uint64_t escape = (1u << countLength) - 1;
+        
+        // the bits written must be the bits the scanner counted
+        uint64_t c = 0;
+        
+        BitRleSpansCompressor compressor(table);
+        compressor.BeginCompress([&](const BitRleSpan& span)
+        {
+            if (nullptr != span.literals)
+            {
+                w.WriteBits((span.length - 1) << 1, 1 + literalLength);
+                for (uint64_t i = 0; i < span.length; ++i)
+                {
+                    w.WriteBits(span.literals[i], valueLength);
+                }
+                c += 1 + literalLength + span.length * valueLength;
+                return;
+            }
+            
+            const uint64_t field = std::min(span.length - minRun, escape);
+            w.WriteBits(1 | (static_cast<uint64_t>(span.value) << 1) | (field << (1 + valueLength)), 1 + valueLength + countLength);
+            c += 1 + valueLength + countLength;
+            
+            if (escape == field)
+            {
+                const unsigned int n = CountBits64(span.length);
+                w.WriteBits(n - 1, BitRleLongRunBits);
+                w.WriteBits(span.length, n);
+                c += BitRleLongRunBits + n;
+            }
+        });
+        forEachSpan([&](const unsigned char* data, size_t n)
+        {
+            compressor.Compress(data, n);
+        });
+        compressor.EndCompress();
+        
+        check_true( c == cntBits );
     }
     
-    check_true( source.Seek(0) );
-    
-    BitStreamWriter w(&dest);
+    check_true( w.CompleteByte() );
+}
+
+// Fills a run of repeats bytes of value by words, up to BitRleFillPadding - 1 bytes more are written.
+// Most runs take the first two words only.
+static inline void FillBitRleRun(unsigned char* out, unsigned char value, unsigned int repeats)
+{
+    const uint64_t word = 0x0101010101010101ull * value;
+    memcpy(out, &word, sizeof(word));
+    memcpy(out + 8, &word, sizeof(word));
+    for (unsigned int i = BitRleFillPadding; i < repeats; i += BitRleFillPadding)
+    {
+        memcpy(out + i, &word, sizeof(word));
+        memcpy(out + i + 8, &word, sizeof(word));
+    }
+}
+
+// Fills the runs of n fields of bits. A value or repeats above 255 fails the whole batch before
+// any run of it is written.
+template <unsigned int ValueLength, unsigned int RepeatsLength>
+static inline unsigned char* FillBitRleRuns(unsigned char* op, uint64_t bits, unsigned int n, unsigned int minValue, unsigned int minRepeats)
+{
+    enum { RunLength = ValueLength + RepeatsLength };
     
-    CompressBitRleTable(w, table);
-    check_true( w.WriteBits(cntBits) );
+    unsigned int high = 0;
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        const uint64_t run = bits >> (i * RunLength);
+        high |= static_cast<unsigned int>(run & LowBitsMask(ValueLength)) + minValue;
+        high |= static_cast<unsigned int>((run >> ValueLength) & LowBitsMask(RepeatsLength)) + minRepeats;
+    }
+    check_true( high <= 255 );
     
-    auto sink = [&](const CodeLength& value, const CodeLength& repeats)
+    for (unsigned int i = 0; i < n; ++i)
     {
-        check_true( w.WriteBits(&value.code, value.length) );
-        check_true( w.WriteBits(&repeats.code, repeats.length) );
-    };
+        const unsigned int v = static_cast<unsigned int>(bits & LowBitsMask(ValueLength)) + minValue;
+        const unsigned int repeats = static_cast<unsigned int>((bits >> ValueLength) & LowBitsMask(RepeatsLength)) + minRepeats;
+        bits >>= RunLength;
+        
+        FillBitRleRun(op, static_cast<unsigned char>(v), repeats);
+        op += repeats;
+    }
+    return op;
+}
+
+// Both fields of a run fit into a byte, so a refill of the reader holds several runs; they are decoded
+// from a single peek and filled into a large window of the output. The decoder is instantiated for each
+// pair of lengths of the fields, the runs of a whole batch are at constant shifts.
+template <unsigned int ValueLength, unsigned int RepeatsLength>
+static void DecompressBitRleRuns(BitStreamReader& r, const BitRleTable& table, uint64_t countRuns, ZeroCopyWriter& writer)
+{
+    enum { RunLength = ValueLength + RepeatsLength, BatchSize = BitStreamMaxFastBits / RunLength };
+    
+    const unsigned int minValue = table.GetMinValue();
+    const unsigned int minRepeats = table.GetMinRepeats();
     
-    BitRleCompressor compressor(table);
-    compressor.BeginCompress(sink);
-    for (unsigned char b = 0; sizeof(b) == source.Read(&b, sizeof(b));)
+    // the repeats field of a table can hold more than 255 less its min, a batch fits into the window
+    // with the largest repeats the table decodes
+    const size_t batchBytes = BatchSize * (minRepeats + LowBitsMask(RepeatsLength)) + BitRleFillPadding;
+    
+    unsigned char* out = writer.Reserve(OutputWindowSize);
+    size_t outSize = 0;
+    
+    while (0 != countRuns)
     {
-        compressor.Compress(b);
+        if ((OutputWindowSize - outSize) < batchBytes)
+        {
+            writer.Commit(outSize);
+            out = writer.Reserve(OutputWindowSize);
+            outSize = 0;
+        }
+        
+        unsigned char* op = out + outSize;
+        if (countRuns >= BatchSize)
+        {
+            const uint64_t bits = r.PeekBits(BatchSize * RunLength);
+            r.SkipBits(BatchSize * RunLength);
+            op = FillBitRleRuns<ValueLength, RepeatsLength>(op, bits, BatchSize, minValue, minRepeats);
+            countRuns -= BatchSize;
+        }
+        else
+        {
+            const unsigned int n = static_cast<unsigned int>(countRuns);
+            const uint64_t bits = r.PeekBits(n * RunLength);
+            r.SkipBits(n * RunLength);
+            op = FillBitRleRuns<ValueLength, RepeatsLength>(op, bits, n, minValue, minRepeats);
+            countRuns = 0;
+        }
+        
+        check_true( !r.IsOverrun() );
+        outSize = op - out;
     }
-    compressor.EndCompress();
     
-    check_true( w.CompleteByte() );
+    writer.Commit(outSize);
 }
 
-void BitRle::Decompress(ISequentialReadStream& source, ISequentialWriteStream& dest)
-{    
-    BitStreamReader r(&source);
+typedef void (*DecompressBitRleRunsFunction)(BitStreamReader& r, const BitRleTable& table, uint64_t countRuns, ZeroCopyWriter& writer);
+
+// Decoders of a value length for each repeats length of 1 to 8 bits
+template <unsigned int ValueLength>
+static DecompressBitRleRunsFunction GetDecompressBitRleRuns(unsigned int repeatsLength)
+{
+    static const DecompressBitRleRunsFunction decoders[BitsPerByte] =
+    {
+        DecompressBitRleRuns<ValueLength, 1>, DecompressBitRleRuns<ValueLength, 2>,
+        DecompressBitRleRuns<ValueLength, 3>, DecompressBitRleRuns<ValueLength, 4>,
+        DecompressBitRleRuns<ValueLength, 5>, DecompressBitRleRuns<ValueLength, 6>,
+        DecompressBitRleRuns<ValueLength, 7>, DecompressBitRleRuns<ValueLength, 8>
+    };
+    
+    return decoders[repeatsLength - 1];
+}
+
+static void DecompressBitRlePayload(BitStreamReader& r, const BitRleTable& table, uint64_t cntBits, ZeroCopyWriter& writer)
+{
+    static DecompressBitRleRunsFunction (* const decoders[BitsPerByte])(unsigned int repeatsLength) =
+    {
+        GetDecompressBitRleRuns<1>, GetDecompressBitRleRuns<2>, GetDecompressBitRleRuns<3>, GetDecompressBitRleRuns<4>,
+        GetDecompressBitRleRuns<5>, GetDecompressBitRleRuns<6>, GetDecompressBitRleRuns<7>, GetDecompressBitRleRuns<8>
+    };
+    
+    const unsigned int valueLength = table.GetValueLength();
+    const unsigned int repeatsLength = table.GetRepeatsLength();
+    check_true( 0 < valueLength && valueLength <= BitsPerByte );
+    check_true( 0 < repeatsLength && repeatsLength <= BitsPerByte );
     
-    const BitRleTable& table = DecompressBitRleTable(r);
+    const unsigned int runLength = valueLength + repeatsLength;
+    check_true( 0 == (cntBits % runLength) );
     
-    check_true( table.GetValueLength() <= BitsPerByte );
-    check_true( table.GetRepeatsLength() <= BitsPerByte );
+    decoders[valueLength - 1](repeatsLength)(r, table, cntBits / runLength, writer);
+}
+
+// Spans of literals take up to 256 bytes of a window, runs are filled across windows
+static void DecompressBitRleSpansPayload(BitStreamReader& r, const BitRleTable& table, uint64_t size, uint64_t cntBits, ZeroCopyWriter& writer)
+{
+    const unsigned int valueLength = table.GetValueLength();
+    const unsigned int minValue = table.GetMinValue();
+    const unsigned int minRun = table.GetMinRun();
+    const unsigned int countLength = table.GetCountLength();
+    const unsigned int literalLength = table.GetLiteralLength();
+    const uint64_t escape = (1u << countLength) - 1;
+    const uint64_t valueMask = LowBitsMask(valueLength);
     
-    unsigned int cntBits = 0;
-    check_true( r.ReadBits(&cntBits) );
+    // literals read by a single peek
+    const unsigned int batchSize = BitStreamMaxFastBits / valueLength;
     
-    std::vector<unsigned char> buff(256);
+    unsigned char* out = writer.Reserve(OutputWindowSize);
+    size_t outSize = 0;
     
-    unsigned int c = 0;
+    uint64_t c = 0;
     while (c < cntBits)
     {
-        unsigned char value = 0;
-        unsigned char repeats = 0;
-        check_true( r.ReadBits(&value, table.GetValueLength()) );
-        check_true( r.ReadBits(&repeats, table.GetRepeatsLength()) );
+        if (0 == r.ReadBits(1))
+        {
+            const unsigned int count = static_cast<unsigned int>(r.ReadBits(literalLength)) + 1;
+            c += 1 + literalLength + static_cast<uint64_t>(count) * valueLength;
+            check_true( count <= size );
+            size -= count;
+            
+            if ((OutputWindowSize - outSize) < count)
+            {
+                writer.Commit(outSize);
+                out = writer.Reserve(OutputWindowSize);
+                outSize = 0;
+            }
+            
+            unsigned int high = 0;
+            for (unsigned int i = 0; i < count;)
+            {
+                const unsigned int n = std::min(count - i, batchSize);
+                uint64_t bits = r.PeekBits(n * valueLength);
+                r.SkipBits(n * valueLength);
+                
+                for (const unsigned int end = i + n; i < end; ++i)
+                {
+                    const unsigned int v = static_cast<unsigned int>(bits & valueMask) + minValue;
+                    bits >>= valueLength;
+                    high |= v;
+                    out[outSize + i] = static_cast<unsigned char>(v);
+                }
+            }
+            
+            check_true( high <= 255 );
+            outSize += count;
+        }
+        else
+        {
+            const unsigned int v = static_cast<unsigned int>(r.ReadBits(valueLength)) + minValue;
+            const uint64_t field = r.ReadBits(countLength);
+            c += 1 + valueLength + countLength;
+            check_true( v <= 255 );
+            
+            uint64_t length = field + minRun;
+            if (escape == field)
+            {
+                const unsigned int n = static_cast<unsigned int>(r.ReadBits(BitRleLongRunBits)) + 1;
+                length = r.ReadBits(n);
+                c += BitRleLongRunBits + n;
+            }
+            check_true( length <= size );
+            size -= length;
+            
+            while (0 != length)
+            {
+                if (OutputWindowSize == outSize)
+                {
+                    writer.Commit(outSize);
+                    out = writer.Reserve(OutputWindowSize);
+                    outSize = 0;
+                }
+                
+                const size_t n = static_cast<size_t>(std::min<uint64_t>(length, OutputWindowSize - outSize));
+                memset(out + outSize, static_cast<int>(v), n);
+                outSize += n;
+                length -= n;
+            }
+        }
+        
+        check_true( !r.IsOverrun() );
+    }
+    
+    check_true( c == cntBits && 0 == size );
+    
+    writer.Commit(outSize);
+}
+
+//
+//
+//
+
+BitRle::BitRle(const CompressorOptions& options)
+: m_blockSize(options.blockSize)
+{
+}
+
+void BitRle::Compress(IReadStream& source, ISequentialWriteStream& dest)
+{
+    // sources that can not be rewound are compressed in blocks
+    const bool seekable = source.Seek(0);
+    
+    WriteFormatHeader(dest, BitRleFormatVersion);
+    
+    BitStreamWriter w(&dest);
+    BitRleScanner scanner;
+    BitRleTable table;
+    uint64_t cntBits = 0;
+    
+    if (0 == m_blockSize && seekable)
+    {
+        uint64_t size = 0;
         
-        check_true( ((unsigned int)value + table.GetMinValue()) <= 255 );
-        check_true( ((unsigned int)repeats + table.GetMinRepeats()) <= 255 );
+        scanner.BeginScan();
+        ForEachSpan(source, [&](const unsigned char* data, size_t n)
+        {
+            scanner.Scan(data, n);
+            size += n;
+        });
+        scanner.EndScan(table, cntBits);
         
-        value += table.GetMinValue();
-        repeats += table.GetMinRepeats();
+        check_true( source.Seek(0) );
         
-        for (unsigned int i = 0; i < repeats; ++i) buff[i] = value;
+        if (0 != size)
+        {
+            CompressBitRleBlock(w, table, size, cntBits, [&](std::function<void(const unsigned char*, size_t)> f)
+            {
+                ForEachSpan(source, f);
+            });
+        }
+    }
+    else
+    {
+        ForEachBlock(source, (0 != m_blockSize) ? m_blockSize : DefaultBlockSize, [&](const unsigned char* data, size_t n)
+        {
+            scanner.BeginScan();
+            scanner.Scan(data, n);
+            scanner.EndScan(table, cntBits);
+            
+            CompressBitRleBlock(w, table, n, cntBits, [&](std::function<void(const unsigned char*, size_t)> f)
+            {
+                f(data, n);
+            });
+        });
+    }
+    
+    const unsigned char more = 0;
+    check_true( w.WriteBits(more) );
+    check_true( w.CompleteByte() );
+}
+
+void BitRle::Decompress(ISequentialReadStream& source, ISequentialWriteStream& dest)
+{
+    unsigned char version = 0;
+    uint32_t head = 0;
+    check_true( ReadFormatHeader(source, &version, &head) );
+    check_true( LegacyFormatVersion <= version && version <= BitRleFormatVersion );
+    
+    BitStreamReader r(&source);
+    ZeroCopyWriter writer(&dest);
+    
+    if (version >= BitRleBlocksFormatVersion)
+    {
+        for (;;)
+        {
+            unsigned char more = 0;
+            check_true( r.ReadBits(&more) );
+            if (0 == more)
+                break;
+            check_true( BitRlePairsBlock == more || (BitRleSpansBlock == more && version >= BitRleFormatVersion) );
+            
+            const BitRleTable& table = (BitRlePairsBlock == more) ? DecompressBitRleTable(r) : DecompressBitRleSpansTable(r);
+            
+            uint64_t cntBits = 0;
+            check_true( r.ReadBits(&cntBits) );
+            
+            if (BitRlePairsBlock == more)
+            {
+                DecompressBitRlePayload(r, table, cntBits, writer);
+            }
+            else
+            {
+                uint64_t size = 0;
+                check_true( r.ReadBits(&size) );
+                DecompressBitRleSpansPayload(r, table, size, cntBits, writer);
+            }
+            
+            r.AlignToByte();
+        }
+    }
+    else
+    {
+        // versions 1 and 2 hold a single block without the "more" byte,
+        // legacy streams start with the table and store a 32-bit payload length
+        const BitRleTable& table = (LegacyFormatVersion == version) ? DecompressLegacyBitRleTable(head) : DecompressBitRleTable(r);
         
-        check_true( dest.Write(&buff[0], repeats) == repeats );
+        uint64_t cntBits = 0;
+        if (LegacyFormatVersion == version)
+        {
+            uint32_t legacyCntBits = 0;
+            check_true( r.ReadBits(&legacyCntBits) );
+            cntBits = legacyCntBits;
+        }
+        else
+        {
+            check_true( r.ReadBits(&cntBits) );
+        }
         
-        c += table.GetValueLength() + table.GetRepeatsLength();
+        DecompressBitRlePayload(r, table, cntBits, writer);
     }
     
-    check_true( c == cntBits );
+    writer.Flush();
 }
@@ -5,6 +5,11 @@
 class BitRle : public ICompressor
 {
 public:
+    BitRle(const CompressorOptions& options = CompressorOptions());
+    
     virtual void Compress(IReadStream& source, ISequentialWriteStream& dest);
     virtual void Decompress(ISequentialReadStream& source, ISequentialWriteStream& dest);
+    
+private:
+    const size_t m_blockSize;
 };
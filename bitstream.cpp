@@ -1,14 +1,26 @@
 #include "bitstream.h"
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+
+//
+//
+//
+
+enum { BitStreamWindowSize = 1 << 16 };
 
 //
 //
 //
 
 BitStreamReader::BitStreamReader(ISequentialReadStream* stream)
-: m_holder(0)
-, m_offset(BitsPerByte)
-, m_stream(stream)
+: m_bits(0)
+, m_count(0)
+, m_padBits(0)
+, m_reader(stream, BitStreamWindowSize)
+, m_window(nullptr)
+, m_next(nullptr)
+, m_end(nullptr)
 {
     assert(nullptr != stream);
 }
@@ -19,50 +31,102 @@ bool BitStreamReader::ReadBits(void* data, unsigned int countBits)
     
     unsigned char* b = reinterpret_cast<unsigned char*>(data);
     
-    unsigned int o = 0;
-    unsigned int c = countBits;
-    
-    *b = 0;
-    
-    while (c > 0)
+    while (countBits > 0)
     {
-        if (BitsPerByte == m_offset)
+        const unsigned int n = std::min(countBits, 32u);
+        const uint64_t value = ReadBits(n);
+        for (unsigned int i = 0; i < n; i += BitsPerByte)
         {
-            if (!Read(&m_holder, sizeof(m_holder)))
-                return false;
-            m_offset = 0;
+            *b++ = static_cast<unsigned char>(value >> i);
         }
-        
-        if (BitsPerByte == o)
+        countBits -= n;
+    }
+    
+    return !IsOverrun();
+}
+
+void BitStreamReader::RefillSlow()
+{
+    while (m_count <= BitStreamMaxFastBits)
+    {
+        if (m_next == m_end)
         {
-            ++b;
-            *b = 0;
-            o = 0;
+            if (!NextWindow())
+            {
+                // end of the stream, continue with zero bytes
+                m_padBits += BitsPerByte;
+                m_count += BitsPerByte;
+                continue;
+            }
+            
+            if ((m_end - m_next) >= 8)
+            {
+                Refill();
+                return;
+            }
         }
         
-        unsigned int space = BitsPerByte - m_offset;
-        
-        unsigned int ss = (c <= space) ? c : space;
-        unsigned int ds = BitsPerByte - o;
-        unsigned int s = (ss < ds) ? ss : ds;
-        
-        unsigned int mask = (1 << s) - 1;
-        
-        unsigned int val = (m_holder >> m_offset) & mask;
-        
-        *b |= (val << o);
-        
-        o += s;
-        m_offset += s;
-        c -= s;
+        m_bits |= static_cast<uint64_t>(*m_next++) << m_count;
+        m_count += BitsPerByte;
     }
+}
+
+bool BitStreamReader::NextWindow()
+{
+    m_reader.Consume(m_end - m_window);
+    
+    size_t size = 0;
+    m_window = m_next = m_reader.Peek(&size);
+    m_end = m_next + size;
     
+    if (0 == size)
+    {
+        m_window = m_next = m_end = nullptr;
+        return false;
+    }
     return true;
 }
 
-bool BitStreamReader::Read(void* data, unsigned int size)
+void BitStreamReader::AlignToByte()
+{
+    SkipBits(m_count % BitsPerByte);
+}
+
+bool BitStreamReader::ReadBytes(void* data, size_t size)
 {
-    return (m_stream->Read(data, size) == size);
+    assert(nullptr != data || 0 == size);
+    assert(0 == (m_count % BitsPerByte));
+    
+    unsigned char* b = reinterpret_cast<unsigned char*>(data);
+    
+    // bytes already taken into m_bits
+    for (; size > 0 && m_count > 0; --size)
+    {
+        *b++ = static_cast<unsigned char>(m_bits);
+        SkipBits(BitsPerByte);
+    }
+    
+    if (IsOverrun())
+        return false;
+    if (0 == size)
+        return true;
+    
+    // the rest comes from the window, bits left above m_count would no longer match it
+    m_bits = 0;
+    
+    while (size > 0)
+    {
+        if (m_next == m_end && !NextWindow())
+            return false;
+        
+        const size_t n = std::min(size, static_cast<size_t>(m_end - m_next));
+        memcpy(b, m_next, n);
+        m_next += n;
+        b += n;
+        size -= n;
+    }
+    
+    return true;
 }
 
 //
@@ -70,9 +134,12 @@ bool BitStreamReader::Read(void* data, unsigned int size)
 //
 
 BitStreamWriter::BitStreamWriter(ISequentialWriteStream* stream)
-: m_holder(0)
-, m_offset(0)
-, m_stream(stream)
+: m_bits(0)
+, m_count(0)
+, m_writer(stream, BitStreamWindowSize)
+, m_window(nullptr)
+, m_next(nullptr)
+, m_end(nullptr)
 {
     assert(nullptr != stream);
 }
@@ -83,40 +150,16 @@ bool BitStreamWriter::WriteBits(const void* data, unsigned int countBits)
     
     const unsigned char* b = reinterpret_cast<const unsigned char*>(data);
     
-    unsigned int i = 0;
-    unsigned int c = countBits;
-    
-    while (c > 0)
+    while (countBits > 0)
     {
-        if (BitsPerByte == m_offset)
-        {
-            if (!Write(&m_holder, sizeof(m_holder)))
-                return false;
-            m_holder = 0;
-            m_offset = 0;
-        }
-        
-        if (BitsPerByte == i)
+        const unsigned int n = std::min(countBits, 32u);
+        uint64_t value = 0;
+        for (unsigned int i = 0; i < n; i += BitsPerByte)
         {
-            ++b;
-            i = 0;
+            value |= static_cast<uint64_t>(*b++) << i;
         }
-        
-        unsigned int space = BitsPerByte - m_offset;
-        
-        unsigned int ss = (c <= space) ? c : space;
-        unsigned int ds = BitsPerByte - i;
-        unsigned int s = (ss < ds) ? ss : ds;
-        
-        unsigned int mask = (1 << s) - 1;
-        
-        unsigned int val = (*b >> i) & mask;
-        
-        m_holder |= (val << m_offset);
-        
-        i += s;
-        m_offset += s;
-        c -= s;
+        WriteBits(value, n);
+        countBits -= n;
     }
     
     return true;
@@ -124,22 +167,103 @@ bool BitStreamWriter::WriteBits(const void* data, unsigned int countBits)
 
 bool BitStreamWriter::CompleteByte()
 {
-    if (0 != m_offset)
+    m_count = (m_count + BitsPerByte - 1) & ~(BitsPerByte - 1);
+    
+    FlushBits();
+    
+    if (nullptr != m_window)
     {
-        if (!Write(&m_holder, sizeof(m_holder)))
-            return false;
-        m_holder = 0;
-        m_offset = 0;
+        m_writer.Commit(m_next - m_window);
+        m_window = m_next = m_end = nullptr;
     }
+    m_writer.Flush();
+    
     return true;
 }
 
 bool BitStreamWriter::IsByteComplete() const
 {
-    return (m_offset == 0);
+    return (0 == (m_count % BitsPerByte));
+}
+
+bool BitStreamWriter::WriteBytes(const void* data, size_t size)
+{
+    assert(nullptr != data || 0 == size);
+    assert(IsByteComplete());
+    
+    if (0 != m_count)
+        FlushBits();
+    
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(data);
+    
+    while (size > 0)
+    {
+        if (m_next == m_end)
+            FlushWindow();
+        
+        const size_t n = std::min(size, static_cast<size_t>(m_end - m_next));
+        memcpy(m_next, b, n);
+        m_next += n;
+        b += n;
+        size -= n;
+    }
+    
+    return true;
 }
 
-bool BitStreamWriter::Write(const void* data, unsigned int size)
+void BitStreamWriter::FlushBits()
 {
-    return (m_stream->Write(data, size) == size);
+    if ((m_end - m_next) < 8)
+        FlushWindow();
+    
+    // stores whole bytes, bits of the partial byte are stored again by the next flush
+    StoreLE64(m_next, m_bits);
+    m_next += m_count / BitsPerByte;
+    
+    const unsigned int flushed = m_count & ~(BitsPerByte - 1);
+    m_bits = (flushed < 64) ? (m_bits >> flushed) : 0;
+    m_count -= flushed;
+}
+
+void BitStreamWriter::FlushWindow()
+{
+    if (nullptr != m_window)
+    {
+        m_writer.Commit(m_next - m_window);
+    }
+    
+    m_window = m_next = m_writer.Reserve(BitStreamWindowSize);
+    m_end = m_window + BitStreamWindowSize;
+}
+
+//
+//
+//
+
+PackBitsFunction GetPackBits(unsigned int width)
+{
+    static const PackBitsFunction kernels[BitStreamMaxFieldBits] =
+    {
+        PackBits<1>,  PackBits<2>,  PackBits<3>,  PackBits<4>,  PackBits<5>,  PackBits<6>,  PackBits<7>,  PackBits<8>,
+        PackBits<9>,  PackBits<10>, PackBits<11>, PackBits<12>, PackBits<13>, PackBits<14>, PackBits<15>, PackBits<16>,
+        PackBits<17>, PackBits<18>, PackBits<19>, PackBits<20>, PackBits<21>, PackBits<22>, PackBits<23>, PackBits<24>,
+        PackBits<25>, PackBits<26>, PackBits<27>, PackBits<28>, PackBits<29>, PackBits<30>, PackBits<31>, PackBits<32>
+    };
+    
+    assert(0 < width && width <= BitStreamMaxFieldBits);
+    return kernels[width - 1];
+}
+
+UnpackBitsFunction GetUnpackBits(unsigned int width)
+{
+    static const UnpackBitsFunction kernels[BitStreamMaxFieldBits] =
+    {
+        UnpackBits<1>,  UnpackBits<2>,  UnpackBits<3>,  UnpackBits<4>,  UnpackBits<5>,  UnpackBits<6>,  UnpackBits<7>,  UnpackBits<8>,
+        UnpackBits<9>,  UnpackBits<10>, UnpackBits<11>, UnpackBits<12>, UnpackBits<13>, UnpackBits<14>, UnpackBits<15>, UnpackBits<16>,
+        UnpackBits<17>, UnpackBits<18>, UnpackBits<19>, UnpackBits<20>, UnpackBits<21>, UnpackBits<22>, UnpackBits<23>, UnpackBits<24>,
+        UnpackBits<25>, UnpackBits<26>, UnpackBits<27>, UnpackBits<28>, UnpackBits<29>, UnpackBits<30>, UnpackBits<31>, UnpackBits<32>
+    };
+    
+    assert(0 < width && width <= BitStreamMaxFieldBits);
+    return kernels[width - 1];
 }
@@ -1,7 +1,15 @@
 #pragma once
 
 #include "istream.h"
+#include "streamimpl.h"
 #include "common.h"
+#include <cassert>
+
+//
+// Bits are stored LSB first: the first bit of a stream is bit 0 of its first byte.
+//
+
+enum { BitStreamMaxFastBits = 56 };
 
 //
 //
@@ -10,6 +18,8 @@
 class BitStreamReader
 {
 public:
+    // The reader takes the stream's data ahead of the bits consumed,
+    // the stream must not be read directly while the reader is in use.
     BitStreamReader(ISequentialReadStream* stream);
     
     bool ReadBits(void* data, unsigned int countBits);
@@ -17,16 +27,37 @@ public:
     bool ReadBits(T* value)
     { return ReadBits(value, sizeof(T) * BitsPerByte); }
     
+    // Fast path for countBits <= BitStreamMaxFastBits (ReadBits takes up to 64). Bits past the end
+    // of the stream are read as zeros, IsOverrun tells whether that happened.
+    uint64_t PeekBits(unsigned int countBits);
+    void SkipBits(unsigned int countBits);
+    uint64_t ReadBits(unsigned int countBits);
+    
+    bool IsOverrun() const;
+    
+    // Skips the rest of the current byte, counterpart of BitStreamWriter::CompleteByte
+    void AlignToByte();
+    
+    // Reads whole bytes at a byte boundary, false if the stream ends before
+    bool ReadBytes(void* data, size_t size);
+    
 private:
-    bool Read(void* data, unsigned int size);
+    void Refill();
+    void RefillSlow();
+    bool NextWindow();
     
 private:
     BitStreamReader(const BitStreamReader&);
     BitStreamReader& operator=(const BitStreamReader&);
     
-    unsigned char m_holder;
-    unsigned char m_offset;
-    ISequentialReadStream* const m_stream;
+    uint64_t m_bits;         // next bits of the stream, LSB first
+    unsigned int m_count;    // count of valid bits in m_bits
+    unsigned int m_padBits;  // zero bits appended to m_count at the end of the stream
+    
+    ZeroCopyReader m_reader;
+    const unsigned char* m_window;
+    const unsigned char* m_next;
+    const unsigned char* m_end;
 };
 
 //
@@ -36,6 +67,7 @@ private:
 class BitStreamWriter
 {
 public:
+    // Bits are packed into a window of the stream, they reach it with CompleteByte
     BitStreamWriter(ISequentialWriteStream* stream);
     
     bool WriteBits(const void* data, unsigned int countBits);
@@ -43,17 +75,174 @@ public:
     bool WriteBits(const T& value)
     { return WriteBits(&value, sizeof(T) * BitsPerByte); }
     
+    // Fast path for countBits <= BitStreamMaxFastBits (WriteBits takes up to 64),
+    // bits of value above countBits are ignored.
+    bool WriteBits(uint64_t value, unsigned int countBits);
+    
+    // Pads the last byte with zero bits and passes everything written to the stream
     bool CompleteByte();
     bool IsByteComplete() const;
     
+    // Writes whole bytes at a byte boundary
+    bool WriteBytes(const void* data, size_t size);
+    
 private:
-    bool Write(const void* data, unsigned int size);
+    void FlushBits();
+    void FlushWindow();
     
 private:
     BitStreamWriter(const BitStreamWriter&);
     BitStreamWriter& operator=(const BitStreamWriter&);
     
-    unsigned char m_holder;
-    unsigned char m_offset;
-    ISequentialWriteStream* const m_stream;
+    uint64_t m_bits;       // pending bits, LSB first
+    unsigned int m_count;  // count of pending bits in m_bits
+    
+    ZeroCopyWriter m_writer;
+    unsigned char* m_window;
+    unsigned char* m_next;
+    unsigned char* m_end;
 };
+
+//
+//
+//
+
+inline uint64_t LowBitsMask(unsigned int countBits)
+{
+    assert(countBits < 64);
+    return (static_cast<uint64_t>(1) << countBits) - 1;
+}
+
+inline void BitStreamReader::Refill()
+{
+    if ((m_end - m_next) >= 8)
+    {
+        // loads whole bytes up to 56..63 bits, the partial byte above m_count
+        // holds the same bits the next load puts there
+        m_bits |= LoadLE64(m_next) << m_count;
+        m_next += (63 - m_count) >> 3;
+        m_count |= 56;
+    }
+    else
+    {
+        RefillSlow();
+    }
+}
+
+inline uint64_t BitStreamReader::PeekBits(unsigned int countBits)
+{
+    assert(countBits <= BitStreamMaxFastBits);
+    
+    if (m_count < countBits)
+        Refill();
+    return m_bits & LowBitsMask(countBits);
+}
+
+inline void BitStreamReader::SkipBits(unsigned int countBits)
+{
+    assert(countBits <= m_count);
+    
+    m_bits >>= countBits;
+    m_count -= countBits;
+}
+
+inline uint64_t BitStreamReader::ReadBits(unsigned int countBits)
+{
+    if (countBits > BitStreamMaxFastBits)
+    {
+        const uint64_t low = ReadBits(32);
+        return low | (ReadBits(countBits - 32) << 32);
+    }
+    
+    const uint64_t value = PeekBits(countBits);
+    SkipBits(countBits);
+    return value;
+}
+
+inline bool BitStreamReader::IsOverrun() const
+{
+    return m_count < m_padBits;
+}
+
+inline bool BitStreamWriter::WriteBits(uint64_t value, unsigned int countBits)
+{
+    if (countBits > BitStreamMaxFastBits)
+    {
+        WriteBits(value, 32);
+        return WriteBits(value >> 32, countBits - 32);
+    }
+    
+    if ((m_count + countBits) >= 64)
+        FlushBits();
+    
+    m_bits |= (value & LowBitsMask(countBits)) << m_count;
+    m_count += countBits;
+    return true;
+}
+
+//
+// Fields of a fixed width: the kernels of a width go through BitStreamMaxFastBits / Width fields with
+// a single call of the reader or writer, the fields of a call are at constant shifts. A stream picks
+// the kernels of its width once from the tables of GetPackBits and GetUnpackBits.
+//
+
+enum { BitStreamMaxFieldBits = 32 };
+
+typedef void (*PackBitsFunction)(BitStreamWriter& w, const uint32_t* values, size_t count);
+typedef void (*UnpackBitsFunction)(BitStreamReader& r, uint32_t* values, size_t count);
+
+// Writes the low Width bits of count values
+template <unsigned int Width>
+void PackBits(BitStreamWriter& w, const uint32_t* values, size_t count)
+{
+    static_assert(0 < Width && Width <= BitStreamMaxFieldBits, "fields of 1 to 32 bits");
+    enum { Fields = BitStreamMaxFastBits / Width };
+    
+    const uint64_t mask = LowBitsMask(Width);
+    
+    size_t i = 0;
+    for (; (i + Fields) <= count; i += Fields)
+    {
+        uint64_t word = 0;
+        for (unsigned int k = 0; k < Fields; ++k)
+        {
+            word |= (values[i + k] & mask) << (k * Width);
+        }
+        w.WriteBits(word, Fields * Width);
+    }
+    
+    for (; i < count; ++i)
+    {
+        w.WriteBits(values[i], Width);
+    }
+}
+
+// Reads count values of Width bits, IsOverrun tells whether they went past the end of the stream
+template <unsigned int Width>
+void UnpackBits(BitStreamReader& r, uint32_t* values, size_t count)
+{
+    static_assert(0 < Width && Width <= BitStreamMaxFieldBits, "fields of 1 to 32 bits");
+    enum { Fields = BitStreamMaxFastBits / Width };
+    
+    const uint64_t mask = LowBitsMask(Width);
+    
+    size_t i = 0;
+    for (; (i + Fields) <= count; i += Fields)
+    {
+        const uint64_t word = r.PeekBits(Fields * Width);
+        r.SkipBits(Fields * Width);
+        for (unsigned int k = 0; k < Fields; ++k)
+        {
+            values[i + k] = static_cast<uint32_t>((word >> (k * Width)) & mask);
+        }
+    }
+    
+    for (; i < count; ++i)
+    {
+        values[i] = static_cast<uint32_t>(r.ReadBits(Width));
+    }
+}
+
+// Kernels of a width of 1 to BitStreamMaxFieldBits bits
+PackBitsFunction GetPackBits(unsigned int width);
+UnpackBitsFunction GetUnpackBits(unsigned int width);
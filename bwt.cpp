@@ -0,0 +1,432 @@
+#include "bwt.h"
+
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+//
+// SA-IS (Nong, Zhang, Chan): suffixes are typed S or L by whether they are smaller or larger than the next one,
+// the leftmost S-suffixes of runs of S (LMS) are sorted by their substrings up to the next LMS position and
+// the order of all suffixes is induced from them. The LMS substrings are named, and if names repeat the
+// string of names is sorted recursively.
+//
+
+// Text of the top level: the bytes shifted up by 1 and the sentinel 0 after them
+struct SaisByteText
+{
+    const unsigned char* data;
+    int32_t size;
+    
+    int32_t operator[](int32_t i) const { return (i < size) ? data[i] + 1 : 0; }
+};
+
+// Text of names of the recursion, the last name is the sentinel
+struct SaisNameText
+{
+    const int32_t* names;
+    
+    int32_t operator[](int32_t i) const { return names[i]; }
+};
+
+// starts (or ends) of the buckets of the values of a text
+static void GetSaisBuckets(const std::vector<int32_t>& counts, std::vector<int32_t>& buckets, bool ends)
+{
+    int32_t sum = 0;
+    for (size_t c = 0; c < counts.size(); ++c)
+    {
+        sum += counts[c];
+        buckets[c] = ends ? sum : sum - counts[c];
+    }
+}
+
+// L-suffixes are induced from left to right, S-suffixes from right to left
+template <typename Text>
+static void InduceSais(const Text& s, const std::vector<unsigned char>& types, int32_t* sa, int32_t n,
+    const std::vector<int32_t>& counts, std::vector<int32_t>& buckets)
+{
+    GetSaisBuckets(counts, buckets, false);
+    for (int32_t i = 0; i < n; ++i)
+    {
+        const int32_t j = sa[i] - 1;
+        if (j >= 0 && 0 == types[j])
+            sa[buckets[s[j]]++] = j;
+    }
+    
+    GetSaisBuckets(counts, buckets, true);
+    for (int32_t i = n - 1; i >= 0; --i)
+    {
+        const int32_t j = sa[i] - 1;
+        if (j >= 0 && 0 != types[j])
+            sa[--buckets[s[j]]] = j;
+    }
+}
+
+// Suffix array of n values of s below k, s[n - 1] is a sentinel smaller than all other values, n is 2 at least
+template <typename Text>
+static void Sais(const Text& s, int32_t* sa, int32_t n, int32_t k)
+{
+    assert(n >= 2);
+    
+    // 1 for S-suffixes
+    std::vector<unsigned char> types(n);
+    types[n - 1] = 1;
+    for (int32_t i = n - 2; i >= 0; --i)
+    {
+        types[i] = (s[i] < s[i + 1] || (s[i] == s[i + 1] && 0 != types[i + 1])) ? 1 : 0;
+    }
+    
+    auto isLms = [&types](int32_t i) { return i > 0 && 0 != types[i] && 0 == types[i - 1]; };
+    
+    std::vector<int32_t> counts(k);
+    std::vector<int32_t> buckets(k);
+    for (int32_t i = 0; i < n; ++i)
+    {
+        ++counts[s[i]];
+    }
+    
+    // LMS substrings are sorted by inducing from LMS positions at the ends of their buckets
+    GetSaisBuckets(counts, buckets, true);
+    std::fill(sa, sa + n, -1);
+    for (int32_t i = 1; i < n; ++i)
+    {
+        if (isLms(i))
+            sa[--buckets[s[i]]] = i;
+    }
+    InduceSais(s, types, sa, n, counts, buckets);
+    
+    int32_t n1 = 0;
+    for (int32_t i = 0; i < n; ++i)
+    {
+        if (isLms(sa[i]))
+            sa[n1++] = sa[i];
+    }
+    
+    // names in the order of the substrings, stored by position in the upper half (LMS positions are 2 apart at least)
+    std::fill(sa + n1, sa + n, -1);
+    int32_t name = 0;
+    int32_t prev = -1;
+    for (int32_t i = 0; i < n1; ++i)
+    {
+        const int32_t pos = sa[i];
+        bool diff = (-1 == prev);
+        for (int32_t d = 0; !diff; ++d)
+        {
+            if (s[pos + d] != s[prev + d] || types[pos + d] != types[prev + d])
+            {
+                diff = true;
+            }
+            else if (d > 0 && (isLms(pos + d) || isLms(prev + d)))
+            {
+                break;
+            }
+        }
+        
+        if (diff)
+        {
+            ++name;
+            prev = pos;
+        }
+        sa[n1 + pos / 2] = name - 1;
+    }
+    
+    for (int32_t i = n - 1, j = n - 1; i >= n1; --i)
+    {
+        if (sa[i] >= 0)
+            sa[j--] = sa[i];
+    }
+    
+    // the order of the LMS suffixes is the order of the string of their names
+    int32_t* const s1 = sa + n - n1;
+    if (name < n1)
+    {
+        SaisNameText names = { s1 };
+        Sais(names, sa, n1, name);
+    }
+    else
+    {
+        for (int32_t i = 0; i < n1; ++i)
+        {
+            sa[s1[i]] = i;
+        }
+    }
+    
+    // the sorted LMS suffixes go to the ends of their buckets, all suffixes are induced from them
+    for (int32_t i = 1, j = 0; i < n; ++i)
+    {
+        if (isLms(i))
+            s1[j++] = i;
+    }
+    for (int32_t i = 0; i < n1; ++i)
+    {
+        sa[i] = s1[sa[i]];
+    }
+    std::fill(sa + n1, sa + n, -1);
+    
+    GetSaisBuckets(counts, buckets, true);
+    for (int32_t i = n1 - 1; i >= 0; --i)
+    {
+        const int32_t j = sa[i];
+        sa[i] = -1;
+        sa[--buckets[s[j]]] = j;
+    }
+    InduceSais(s, types, sa, n, counts, buckets);
+}
+
+void MakeSuffixArray(const unsigned char* data, size_t size, std::vector<int32_t>& sa)
+{
+    assert(nullptr != data || 0 == size);
+    assert(size < INT32_MAX);
+    
+    sa.resize(size + 1);
+    if (0 == size)
+    {
+        sa[0] = 0;
+        return;
+    }
+    
+    SaisByteText text = { data, static_cast<int32_t>(size) };
+    Sais(text, sa.data(), static_cast<int32_t>(size + 1), ByteTypeCountValues + 1);
+}
+
+//
+//
+//
+
+// first byte of chain j
+static inline size_t GetBwtChainStart(size_t size, unsigned int j)
+{
+    return (size * j) / BwtChains;
+}
+
+BwtEncoder::BwtEncoder()
+{
+}
+
+void BwtEncoder::Encode(const unsigned char* data, size_t size, unsigned char* out, uint32_t rows[BwtChains])
+{
+    assert(nullptr != data && nullptr != out);
+    assert(0 != size && size <= BwtMaxBlockSize);
+    
+    MakeSuffixArray(data, size, m_sa);
+    
+    // the row of a rotation is the rank of its suffix, row 0 is the sentinel's one
+    size_t k = 0;
+    for (size_t i = 0; i <= size; ++i)
+    {
+        const size_t pos = static_cast<size_t>(m_sa[i]);
+        if (0 != pos)
+            out[k++] = data[pos - 1];
+        
+        for (unsigned int j = 0; j < BwtChains; ++j)
+        {
+            if (pos == GetBwtChainStart(size, j))
+                rows[j] = static_cast<uint32_t>(i);
+        }
+    }
+    assert(size == k);
+}
+
+//
+//
+//
+
+BwtDecoder::BwtDecoder()
+{
+}
+
+bool BwtDecoder::Decode(const unsigned char* data, size_t size, const uint32_t rows[BwtChains], unsigned char* out)
+{
+    assert(nullptr != data && nullptr != out);
+    assert(0 != size && size <= BwtMaxBlockSize);
+    
+    // the sentinel is in the last column at the row of the first byte, row 0 starts with the sentinel
+    const size_t primary = rows[0];
+    for (unsigned int j = 0; j < BwtChains; ++j)
+    {
+        if (0 == rows[j] || rows[j] > size)
+            return false;
+    }
+    
+    // row of the first occurrence of a byte value in the first column
+    uint32_t next[ByteTypeCountValues] = {};
+    for (size_t i = 0; i < size; ++i)
+    {
+        ++next[data[i]];
+    }
+    for (unsigned int c = 0, sum = 1; c < ByteTypeCountValues; ++c)
+    {
+        const uint32_t count = next[c];
+        next[c] = sum;
+        sum += count;
+    }
+    
+    // the k-th occurrence of a byte in the last column precedes the k-th occurrence in the first column,
+    // so the row that starts with it is followed by the row of that last column position
+    m_rows.resize(size + 1);
+    m_rows[0] = static_cast<uint32_t>(primary << 8);
+    for (size_t i = 0; i < size; ++i)
+    {
+        const unsigned char c = data[i];
+        const uint32_t row = static_cast<uint32_t>((i < primary) ? i : i + 1);
+        m_rows[next[c]++] = (row << 8) | c;
+    }
+    
+    size_t starts[BwtChains + 1];
+    uint32_t r[BwtChains];
+    for (unsigned int j = 0; j < BwtChains; ++j)
+    {
+        starts[j] = GetBwtChainStart(size, j);
+        r[j] = rows[j];
+    }
+    starts[BwtChains] = size;
+    
+    // chains differ in length by one byte at most, they are followed together up to the shortest one
+    const uint32_t* const table = m_rows.data();
+    
+    size_t shortest = size;
+    for (unsigned int j = 0; j < BwtChains; ++j)
+    {
+        shortest = std::min(shortest, starts[j + 1] - starts[j]);
+    }
+    
+    for (size_t i = 0; i < shortest; ++i)
+    {
+        uint32_t e[BwtChains];
+        for (unsigned int j = 0; j < BwtChains; ++j)
+        {
+            e[j] = table[r[j]];
+        }
+        
+        for (unsigned int j = 0; j < BwtChains; ++j)
+        {
+            out[starts[j] + i] = static_cast<unsigned char>(e[j]);
+            r[j] = e[j] >> 8;
+        }
+    }
+    
+    // a chain ends at the row of the next one, the last one at the sentinel's row
+    for (unsigned int j = 0; j < BwtChains; ++j)
+    {
+        for (size_t i = starts[j] + shortest; i < starts[j + 1]; ++i)
+        {
+            const uint32_t e = table[r[j]];
+            out[i] = static_cast<unsigned char>(e);
+            r[j] = e >> 8;
+        }
+        
+        if (r[j] != ((j + 1 < BwtChains) ? rows[j + 1] : 0))
+            return false;
+    }
+    
+    return true;
+}
+
+//
+//
+//
+
+// Appends the digits of a run of length zero indexes
+static inline void EncodeZeroRun(size_t run, std::vector<uint16_t>& symbols)
+{
+    while (0 != run)
+    {
+        --run;
+        symbols.push_back((0 != (run & 1)) ? BwtRunB : BwtRunA);
+        run >>= 1;
+    }
+}
+
+void EncodeMtfRuns(const unsigned char* data, size_t size, std::vector<uint16_t>& symbols)
+{
+    assert(nullptr != data || 0 == size);
+    
+    unsigned char list[ByteTypeCountValues];
+    for (unsigned int i = 0; i < ByteTypeCountValues; ++i)
+    {
+        list[i] = static_cast<unsigned char>(i);
+    }
+    
+    size_t run = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        const unsigned char b = data[i];
+        if (list[0] == b)
+        {
+            ++run;
+            continue;
+        }
+        
+        EncodeZeroRun(run, symbols);
+        run = 0;
+        
+        // values before b move up by one
+        unsigned char moved = list[0];
+        list[0] = b;
+        unsigned int k = 1;
+        for (; list[k] != b; ++k)
+        {
+            std::swap(moved, list[k]);
+        }
+        list[k] = moved;
+        
+        symbols.push_back(static_cast<uint16_t>(k + 1));
+    }
+    
+    EncodeZeroRun(run, symbols);
+    symbols.push_back(BwtEndSymbol);
+}
+
+bool DecodeMtfRuns(const uint16_t* symbols, size_t count, unsigned char* out, size_t size)
+{
+    assert(nullptr != symbols || 0 == count);
+    assert(nullptr != out || 0 == size);
+    
+    unsigned char list[ByteTypeCountValues];
+    for (unsigned int i = 0; i < ByteTypeCountValues; ++i)
+    {
+        list[i] = static_cast<unsigned char>(i);
+    }
+    
+    size_t pos = 0;
+    size_t run = 0;
+    unsigned int digit = 0;
+    
+    for (size_t i = 0; i < count; ++i)
+    {
+        const unsigned int symbol = symbols[i];
+        assert(symbol < BwtSymbols);
+        
+        if (symbol <= BwtRunB)
+        {
+            // a longer run does not fit into a block
+            if (digit >= 32)
+                return false;
+            run += static_cast<size_t>(symbol + 1) << digit++;
+            continue;
+        }
+        
+        if (0 != run)
+        {
+            if (run > (size - pos))
+                return false;
+            memset(out + pos, list[0], run);
+            pos += run;
+            run = 0;
+            digit = 0;
+        }
+        
+        if (BwtEndSymbol == symbol)
+            return (i + 1) == count && pos == size;
+        
+        if (pos == size)
+            return false;
+        
+        const unsigned int k = symbol - 1;
+        const unsigned char b = list[k];
+        memmove(list + 1, list, k);
+        list[0] = b;
+        out[pos++] = b;
+    }
+    
+    return false;
+}
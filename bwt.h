@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "common.h"
+#include "huffman.h"
+
+//
+// Burrows-Wheeler transform of a block: the last column of the sorted rotations of the block followed
+// by a sentinel smaller than any byte. The sentinel is left out of the transform, its row is the row of
+// the rotation that starts at the first byte.
+//
+
+// rows of the inverse transform are packed with a byte into 32 bits
+enum { BwtMaxBlockSize = (1 << 24) - 1 };
+
+// The inverse transform follows BwtChains chains of rows at once, chain j starts at byte j * size / BwtChains.
+// A step of a chain is a cache miss on a large block, the misses of the chains overlap.
+enum { BwtChains = 16 };
+
+// Suffix array of data with a sentinel: size + 1 positions, sa[0] is size for the sentinel.
+// SA-IS, linear in size.
+void MakeSuffixArray(const unsigned char* data, size_t size, std::vector<int32_t>& sa);
+
+//
+//
+//
+
+class BwtEncoder
+{
+public:
+    BwtEncoder();
+    
+    // Writes the transform of size bytes of data to out and the rows of the starts of the chains to rows
+    void Encode(const unsigned char* data, size_t size, unsigned char* out, uint32_t rows[BwtChains]);
+    
+private:
+    BwtEncoder(const BwtEncoder&);
+    BwtEncoder& operator=(const BwtEncoder&);
+    
+    std::vector<int32_t> m_sa;
+};
+
+//
+//
+//
+
+class BwtDecoder
+{
+public:
+    BwtDecoder();
+    
+    // Inverse of BwtEncoder::Encode, false if rows are not the rows of a transform of size bytes
+    bool Decode(const unsigned char* data, size_t size, const uint32_t rows[BwtChains], unsigned char* out);
+    
+private:
+    BwtDecoder(const BwtDecoder&);
+    BwtDecoder& operator=(const BwtDecoder&);
+    
+    // a row holds its first byte in the low 8 bits and the row of the next rotation above them
+    std::vector<uint32_t> m_rows;
+};
+
+//
+// Move-to-front and zero runs: a byte is coded by its index in a list of byte values that moves it to
+// the front, runs of index 0 are coded as bijective base-2 numbers of the digits BwtRunA (1) and BwtRunB (2)
+// from the lowest digit up, index v > 0 is symbol v + 1, BwtEndSymbol ends a block.
+//
+
+enum { BwtRunA = 0, BwtRunB = 1, BwtEndSymbol = ByteTypeCountValues + 1, BwtSymbols = BwtEndSymbol + 1 };
+
+// Appends the symbols of data and BwtEndSymbol to symbols
+void EncodeMtfRuns(const unsigned char* data, size_t size, std::vector<uint16_t>& symbols);
+
+// Decodes symbols up to BwtEndSymbol into size bytes of out, false if they do not hold size bytes
+bool DecodeMtfRuns(const uint16_t* symbols, size_t count, unsigned char* out, size_t size);
@@ -0,0 +1,404 @@
+#include "bwtcompressor.h"
+#include "bwt.h"
+#include "huffman.h"
+#include "streamimpl.h"
+#include "bitstream.h"
+#include "format.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <memory>
+
+enum { BwtFormatVersion = 2 };
+
+// "more" bytes of the blocks
+enum { BwtCodedBlock = 1, BwtStoredBlock = 2 };
+
+// zero runs leave few frequent symbols, long codes of the rare ones cost little
+enum { BwtMaxCodeLength = 20 };
+
+inline void check_true(bool expr)
+{
+    if (!expr) throw std::exception();
+}
+
+// Symbols are coded in groups of BwtGroupSize symbols, each with the codes of one of up to BwtMaxTables tables.
+// The tables start out each favouring a range of symbols of about equal frequency, then every iteration takes the
+// cheapest table for each group and rebuilds the tables from their groups.
+enum { BwtGroupSize = 50, BwtMaxTables = 6, BwtTableIterations = 4 };
+
+// cost of a symbol out of the range of an initial table or missing from a table
+enum { BwtMissingCost = BwtMaxCodeLength + 1 };
+
+static unsigned int GetBwtTableCount(size_t countSymbols)
+{
+    return (countSymbols < 200) ? 2 : (countSymbols < 600) ? 3 : (countSymbols < 1200) ? 4 : (countSymbols < 2400) ? 5 : BwtMaxTables;
+}
+
+// Builds the tables of the groups of symbols and the table of each group, unused tables are left out
+static void MakeBwtTables(HuffmanScanner& scanner, const std::vector<uint16_t>& symbols, std::vector<HuffmanCodeTable>& tables,
+    std::vector<unsigned char>& selectors)
+{
+    const size_t count = symbols.size();
+    const size_t countGroups = (count + BwtGroupSize - 1) / BwtGroupSize;
+    unsigned int countTables = GetBwtTableCount(count);
+    
+    size_t frequencies[BwtSymbols] = {};
+    for (const uint16_t symbol : symbols)
+    {
+        ++frequencies[symbol];
+    }
+    
+    // costs of the tables of a symbol are adjacent
+    std::vector<unsigned char> costs(BwtSymbols * BwtMaxTables, BwtMissingCost);
+    
+    size_t remaining = count;
+    for (unsigned int t = 0, v = 0; t < countTables; ++t)
+    {
+        const size_t target = remaining / (countTables - t);
+        size_t sum = 0;
+        for (; v < BwtSymbols && (sum < target || (t + 1) == countTables); ++v)
+        {
+            sum += frequencies[v];
+            costs[v * BwtMaxTables + t] = 0;
+        }
+        remaining -= sum;
+    }
+    
+    tables.assign(countTables, HuffmanCodeTable(BwtSymbols));
+    selectors.resize(countGroups);
+    
+    for (unsigned int iteration = 0; iteration < BwtTableIterations; ++iteration)
+    {
+        for (size_t g = 0; g < countGroups; ++g)
+        {
+            const size_t first = g * BwtGroupSize;
+            const size_t last = std::min(first + BwtGroupSize, count);
+            
+            unsigned int groupCosts[BwtMaxTables] = {};
+            for (size_t i = first; i < last; ++i)
+            {
+                const unsigned char* symbolCosts = &costs[symbols[i] * BwtMaxTables];
+                for (unsigned int t = 0; t < BwtMaxTables; ++t)
+                {
+                    groupCosts[t] += symbolCosts[t];
+                }
+            }
+            
+            unsigned int best = 0;
+            for (unsigned int t = 1; t < countTables; ++t)
+            {
+                if (groupCosts[t] < groupCosts[best])
+                    best = t;
+            }
+            selectors[g] = static_cast<unsigned char>(best);
+        }
+        
+        for (unsigned int t = 0; t < countTables; ++t)
+        {
+            scanner.BeginScan();
+            for (size_t g = 0; g < countGroups; ++g)
+            {
+                if (selectors[g] != t)
+                    continue;
+                
+                const size_t first = g * BwtGroupSize;
+                const size_t last = std::min(first + BwtGroupSize, count);
+                for (size_t i = first; i < last; ++i)
+                {
+                    scanner.Scan(symbols[i]);
+                }
+            }
+            
+            uint64_t totalLen = 0;
+            scanner.EndScan(tables[t], totalLen);
+            
+            for (unsigned int v = 0; v < BwtSymbols; ++v)
+            {
+                const unsigned int length = tables[t].GetCodeLength(v).length;
+                costs[v * BwtMaxTables + t] = static_cast<unsigned char>((0 != length) ? length : BwtMissingCost);
+            }
+        }
+    }
+    
+    // tables without groups move out of the way
+    unsigned char moves[BwtMaxTables] = {};
+    std::vector<bool> used(countTables);
+    for (const unsigned char selector : selectors)
+    {
+        used[selector] = true;
+    }
+    
+    unsigned int kept = 0;
+    for (unsigned int t = 0; t < countTables; ++t)
+    {
+        if (!used[t])
+            continue;
+        moves[t] = static_cast<unsigned char>(kept);
+        if (kept != t)
+            tables[kept].swap(tables[t]);
+        ++kept;
+    }
+    tables.resize(kept, HuffmanCodeTable(BwtSymbols));
+    
+    for (unsigned char& selector : selectors)
+    {
+        selector = moves[selector];
+    }
+}
+
+// Coded block: "more" byte BwtCodedBlock, 32 bits of the size of the data, 32 bits of the size of the payload, then
+// the payload: 32 bits of the row of each chain, 8 bits of the count of tables, 32 bits of the count of groups,
+// the selectors of the groups, the code lengths of each table and the codes of the symbols of the transform
+// up to BwtEndSymbol. A selector is the move-to-front index of its table, in unary as 1 bits ended by a 0 bit.
+// Stored block: "more" byte BwtStoredBlock, 32 bits of the size, then the data. Data that does not get smaller
+// is stored. A payload holds all a block needs, so blocks decode independently.
+static void CompressBwtBlock(BitStreamWriter& w, BwtEncoder& encoder, HuffmanScanner& scanner, std::vector<unsigned char>& transform,
+    std::vector<uint16_t>& symbols, std::vector<unsigned char>& block, const unsigned char* data, size_t size)
+{
+    uint32_t rows[BwtChains] = {};
+    transform.resize(size);
+    encoder.Encode(data, size, transform.data(), rows);
+    
+    symbols.clear();
+    EncodeMtfRuns(transform.data(), size, symbols);
+    
+    std::vector<HuffmanCodeTable> tables;
+    std::vector<unsigned char> selectors;
+    MakeBwtTables(scanner, symbols, tables, selectors);
+    
+    block.clear();
+    {
+        ByteArraySequentialWriteStream stream(&block);
+        BitStreamWriter bw(&stream);
+        
+        for (unsigned int j = 0; j < BwtChains; ++j)
+        {
+            check_true( bw.WriteBits(rows[j]) );
+        }
+        
+        const unsigned char countTables = static_cast<unsigned char>(tables.size());
+        const uint32_t countGroups = static_cast<uint32_t>(selectors.size());
+        check_true( bw.WriteBits(countTables) );
+        check_true( bw.WriteBits(countGroups) );
+        
+        unsigned char order[BwtMaxTables] = { 0, 1, 2, 3, 4, 5 };
+        for (const unsigned char selector : selectors)
+        {
+            unsigned int k = 0;
+            while (order[k] != selector)
+            {
+                ++k;
+            }
+            memmove(order + 1, order, k);
+            order[0] = selector;
+            bw.WriteBits((1u << k) - 1, k + 1);
+        }
+        
+        for (const HuffmanCodeTable& table : tables)
+        {
+            WriteHuffmanCodeLengths(bw, table);
+        }
+        
+        for (size_t g = 0; g < selectors.size(); ++g)
+        {
+            const CodeLength* const table = &tables[selectors[g]].GetCodeLength(0);
+            const size_t first = g * BwtGroupSize;
+            const size_t last = std::min(first + BwtGroupSize, symbols.size());
+            for (size_t i = first; i < last; ++i)
+            {
+                const CodeLength& cl = table[symbols[i]];
+                bw.WriteBits(cl.code, cl.length);
+            }
+        }
+        check_true( bw.CompleteByte() );
+    }
+    
+    const uint32_t size32 = static_cast<uint32_t>(size);
+    if (block.size() + sizeof(uint32_t) < size)
+    {
+        const unsigned char more = BwtCodedBlock;
+        const uint32_t blockSize32 = static_cast<uint32_t>(block.size());
+        check_true( w.WriteBits(more) );
+        check_true( w.WriteBits(size32) );
+        check_true( w.WriteBits(blockSize32) );
+        check_true( w.WriteBytes(block.data(), block.size()) );
+    }
+    else
+    {
+        const unsigned char more = BwtStoredBlock;
+        check_true( w.WriteBits(more) );
+        check_true( w.WriteBits(size32) );
+        check_true( w.WriteBytes(data, size) );
+    }
+}
+
+// Decodes the payload of a coded block into size bytes of out
+static void DecompressBwtPayload(BwtDecoder& decoder, std::vector<unsigned char>& block, std::vector<uint16_t>& symbols,
+    std::vector<unsigned char>& transform, unsigned char* out, size_t size)
+{
+    ByteArrayReadStream stream(&block);
+    BitStreamReader r(&stream);
+    
+    uint32_t rows[BwtChains] = {};
+    for (unsigned int j = 0; j < BwtChains; ++j)
+    {
+        check_true( r.ReadBits(&rows[j]) );
+    }
+    
+    // a run of zero indexes takes fewer symbols than bytes, so a block has size + 1 symbols at most
+    unsigned char countTables = 0;
+    uint32_t countGroups = 0;
+    check_true( r.ReadBits(&countTables) );
+    check_true( r.ReadBits(&countGroups) );
+    check_true( 0 != countTables && countTables <= BwtMaxTables );
+    check_true( 0 != countGroups && countGroups <= (size / BwtGroupSize) + 1 );
+    
+    std::vector<unsigned char> selectors(countGroups);
+    unsigned char order[BwtMaxTables] = { 0, 1, 2, 3, 4, 5 };
+    for (unsigned char& selector : selectors)
+    {
+        unsigned int k = 0;
+        while (0 != r.ReadBits(1))
+        {
+            check_true( ++k < countTables );
+        }
+        
+        selector = order[k];
+        memmove(order + 1, order, k);
+        order[0] = selector;
+    }
+    
+    std::vector<std::unique_ptr<const HuffmanDecoder>> decoders(countTables);
+    for (unsigned char t = 0; t < countTables; ++t)
+    {
+        HuffmanCodeTable codes(BwtSymbols);
+        check_true( ReadHuffmanCodeLengths(r, BwtSymbols, codes) );
+        decoders[t].reset(new HuffmanDecoder(codes));
+    }
+    
+    symbols.clear();
+    for (size_t g = 0; ; ++g)
+    {
+        check_true( g < countGroups );
+        const HuffmanDecoder& huffman = *decoders[selectors[g]];
+        
+        unsigned int symbol = 0;
+        for (unsigned int i = 0; i < BwtGroupSize && BwtEndSymbol != symbol; ++i)
+        {
+            check_true( 0 != huffman.Decode(r, &symbol) );
+            symbols.push_back(static_cast<uint16_t>(symbol));
+        }
+        
+        if (BwtEndSymbol == symbol)
+        {
+            check_true( (g + 1) == countGroups );
+            break;
+        }
+    }
+    check_true( !r.IsOverrun() );
+    
+    transform.resize(size);
+    check_true( DecodeMtfRuns(symbols.data(), symbols.size(), transform.data(), size) );
+    check_true( decoder.Decode(transform.data(), size, rows, out) );
+}
+
+// Reads a coded block after its "more" byte
+static void DecompressBwtBlock(BitStreamReader& r, ZeroCopyWriter& writer, BwtDecoder& decoder, std::vector<unsigned char>& block,
+    std::vector<uint16_t>& symbols, std::vector<unsigned char>& transform)
+{
+    uint32_t size = 0;
+    uint32_t blockSize = 0;
+    check_true( r.ReadBits(&size) );
+    check_true( r.ReadBits(&blockSize) );
+    check_true( 0 != size && size <= BwtMaxBlockSize );
+    check_true( blockSize < size );
+    
+    block.resize(blockSize);
+    check_true( r.ReadBytes(block.data(), blockSize) );
+    
+    unsigned char* out = writer.Reserve(size);
+    DecompressBwtPayload(decoder, block, symbols, transform, out, size);
+    writer.Commit(size);
+}
+
+// Reads a stored block after its "more" byte
+static void DecompressBwtStoredBlock(BitStreamReader& r, ZeroCopyWriter& writer)
+{
+    uint32_t size = 0;
+    check_true( r.ReadBits(&size) );
+    check_true( size <= BwtMaxBlockSize );
+    
+    unsigned char* out = writer.Reserve(size);
+    check_true( r.ReadBytes(out, size) );
+    writer.Commit(size);
+}
+
+//
+//
+//
+
+Bwt::Bwt(const CompressorOptions& options)
+: m_blockSize(options.blockSize)
+{
+}
+
+// Stream: blocks until a "more" byte 0, a block starts at a byte boundary
+void Bwt::Compress(IReadStream& source, ISequentialWriteStream& dest)
+{
+    const size_t blockSize = std::min(static_cast<size_t>((0 != m_blockSize) ? m_blockSize : DefaultBlockSize),
+        static_cast<size_t>(BwtMaxBlockSize));
+    
+    WriteFormatHeader(dest, BwtFormatVersion);
+    
+    BitStreamWriter w(&dest);
+    BwtEncoder encoder;
+    HuffmanScanner scanner(BwtMaxCodeLength, BwtSymbols);
+    std::vector<unsigned char> transform;
+    std::vector<uint16_t> symbols;
+    std::vector<unsigned char> block;
+    
+    ForEachBlock(source, blockSize, [&](const unsigned char* data, size_t n)
+    {
+        CompressBwtBlock(w, encoder, scanner, transform, symbols, block, data, n);
+    });
+    
+    const unsigned char more = 0;
+    check_true( w.WriteBits(more) );
+    check_true( w.CompleteByte() );
+}
+
+void Bwt::Decompress(ISequentialReadStream& source, ISequentialWriteStream& dest)
+{
+    unsigned char version = 0;
+    uint32_t head = 0;
+    check_true( ReadFormatHeader(source, &version, &head) );
+    check_true( BwtFormatVersion == version );
+    
+    BitStreamReader r(&source);
+    ZeroCopyWriter writer(&dest);
+    BwtDecoder decoder;
+    std::vector<unsigned char> block;
+    std::vector<uint16_t> symbols;
+    std::vector<unsigned char> transform;
+    
+    for (;;)
+    {
+        unsigned char more = 0;
+        check_true( r.ReadBits(&more) );
+        if (0 == more)
+            break;
+        
+        if (BwtCodedBlock == more)
+        {
+            DecompressBwtBlock(r, writer, decoder, block, symbols, transform);
+        }
+        else
+        {
+            check_true( BwtStoredBlock == more );
+            DecompressBwtStoredBlock(r, writer);
+        }
+    }
+    
+    writer.Flush();
+}
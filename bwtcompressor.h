@@ -0,0 +1,16 @@
+#pragma once
+
+#include "icompressor.h"
+
+class Bwt : public ICompressor
+{
+public:
+    // A block is sorted in memory, so a source is always compressed in blocks
+    Bwt(const CompressorOptions& options = CompressorOptions());
+    
+    virtual void Compress(IReadStream& source, ISequentialWriteStream& dest);
+    virtual void Decompress(ISequentialReadStream& source, ISequentialWriteStream& dest);
+    
+private:
+    const size_t m_blockSize;
+};
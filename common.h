@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstdint>
+#include <cstring>
+
 //
 //
 //
@@ -35,3 +38,41 @@ inline unsigned char CountBits(unsigned int value)
     for (; 0 != value; ++res, value >>= 1);
     return res;
 }
+
+inline unsigned char CountBits64(uint64_t value)
+{
+    return (0 == value) ? 1 : static_cast<unsigned char>(64 - __builtin_clzll(value));
+}
+
+
+//
+//
+//
+
+inline uint32_t LoadLE32(const unsigned char* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    value = __builtin_bswap32(value);
+#endif
+    return value;
+}
+
+inline uint64_t LoadLE64(const unsigned char* p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+inline void StoreLE64(unsigned char* p, uint64_t value)
+{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    value = __builtin_bswap64(value);
+#endif
+    memcpy(p, &value, sizeof(value));
+}
@@ -1,20 +1,34 @@
+#include "compressor.h"
 #include "huffmancompressor.h"
 #include "bitrlecompressor.h"
 #include "lzwcompressor.h"
+#include "fsecompressor.h"
+#include "rangecompressor.h"
+#include "lzcompressor.h"
+#include "lzhcompressor.h"
+#include "bwtcompressor.h"
 #include "streamimpl.h"
 #include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <sys/stat.h>
 
-std::shared_ptr<ICompressor> GetCompressor(const char* compressorName)
+std::shared_ptr<ICompressor> GetCompressor(const char* compressorName, const CompressorOptions& options)
 {
     assert(nullptr != compressorName);
     
     if (0 == strcmp(compressorName, "huffman"))
     {
-        return std::make_shared<Huffman>();
+        return std::make_shared<Huffman>(options);
+    }
+    else if (0 == strcmp(compressorName, "huffman4"))
+    {
+        return std::make_shared<Huffman>(options, true);
     }
     else if (0 == strcmp(compressorName, "bitrle"))
     {
-        return std::make_shared<BitRle>();
+        return std::make_shared<BitRle>(options);
     }
     else if (0 == strcmp(compressorName, "lzw"))
     {
@@ -22,11 +36,42 @@ std::shared_ptr<ICompressor> GetCompressor(const char* compressorName)
     }
     else if (0 == strcmp(compressorName, "bitlzw"))
     {
-        return std::make_shared<BitLzw>();
+        return std::make_shared<BitLzw>(options);
+    }
+    else if (0 == strcmp(compressorName, "fse"))
+    {
+        return std::make_shared<Fse>(options);
+    }
+    else if (0 == strcmp(compressorName, "range"))
+    {
+        return std::make_shared<Range>(options);
+    }
+    else if (0 == strcmp(compressorName, "lz"))
+    {
+        return std::make_shared<Lz>(options);
+    }
+    else if (0 == strcmp(compressorName, "lzh"))
+    {
+        return std::make_shared<Lzh>(options);
+    }
+    else if (0 == strcmp(compressorName, "bwt"))
+    {
+        return std::make_shared<Bwt>(options);
     }
     return std::shared_ptr<ICompressor>();
 }
 
+// "-" stands for stdin or stdout, those are flushed but not closed
+static FILE* OpenFile(const char* fileName, const char* mode, FILE* standardFile)
+{
+    return (0 == strcmp(fileName, "-")) ? standardFile : fopen(fileName, mode);
+}
+
+static int CloseFile(FILE* file)
+{
+    return (stdin == file || stdout == file) ? fflush(file) : fclose(file);
+}
+
 template <typename F>
 void DoAction(ICompressor* compressor, const char* sourceFile, const char* destFile, F f)
 {
@@ -34,30 +79,49 @@ void DoAction(ICompressor* compressor, const char* sourceFile, const char* destF
     assert(nullptr != sourceFile);
     assert(nullptr != destFile);
     
-    std::unique_ptr<FILE, decltype(&fclose)> fileIn(fopen(sourceFile, "rb"), &fclose);
+    std::unique_ptr<FILE, decltype(&CloseFile)> fileIn(OpenFile(sourceFile, "rb", stdin), &CloseFile);
     if (!fileIn)
     {
         throw std::invalid_argument("SourceFile");
     }
     
-    std::unique_ptr<FILE, decltype(&fclose)> fileOut(fopen(destFile, "wb"), &fclose);
+    std::unique_ptr<FILE, decltype(&CloseFile)> fileOut(OpenFile(destFile, "wb", stdout), &CloseFile);
     if (!fileOut)
     {
         throw std::invalid_argument("DestinationFile");
     }
     
-    FileReadStream rs(fileIn.get());
-    FileSequentialWriteStream ws(fileOut.get());
+    // regular files are mapped so both passes of the two-pass codecs run from the page cache,
+    // everything else (pipes, devices) is read through the buffer
+    std::unique_ptr<IReadStream> rs;
+    struct stat st;
+    if (0 == fstat(fileno(fileIn.get()), &st) && S_ISREG(st.st_mode) && 0 != st.st_size)
+    {
+        rs.reset(new MmapReadStream(fileIn.get()));
+    }
+    else
+    {
+        rs.reset(new BufferedFileReadStream(fileIn.get()));
+    }
+    
+    BufferedFileSequentialWriteStream ws(fileOut.get());
     
-    f(compressor, rs, ws);
+    f(compressor, *rs, ws);
+    
+    ws.Flush();
+    
+    if (0 != fflush(fileOut.get()))
+    {
+        throw std::runtime_error("DestinationFile");
+    }
 }
 
 template <typename F>
-void DoAction(const char* compressorName, const char* sourceFile, const char* destFile, F f)
+void DoAction(const char* compressorName, const CompressorOptions& options, const char* sourceFile, const char* destFile, F f)
 {
     assert(nullptr != compressorName);
     
-    std::shared_ptr<ICompressor> compressor = GetCompressor(compressorName);
+    std::shared_ptr<ICompressor> compressor = GetCompressor(compressorName, options);
     if (!compressor)
     {
         throw std::invalid_argument("CompressorName");
@@ -66,10 +130,10 @@ void DoAction(const char* compressorName, const char* sourceFile, const char* de
     DoAction(compressor.get(), sourceFile, destFile, f);
 }
 
-auto compressLambda = [](ICompressor* compressor, FileReadStream& rs, FileSequentialWriteStream& ws)
+auto compressLambda = [](ICompressor* compressor, IReadStream& rs, ISequentialWriteStream& ws)
 { compressor->Compress(rs, ws); };
 
-auto decompressLambda = [](ICompressor* compressor, FileReadStream& rs, FileSequentialWriteStream& ws)
+auto decompressLambda = [](ICompressor* compressor, IReadStream& rs, ISequentialWriteStream& ws)
 { compressor->Decompress(rs, ws); };
 
 void Compress(ICompressor* compressor, const char* sourceFile, const char* destFile)
@@ -84,10 +148,15 @@ void Decompress(ICompressor* compressor, const char* sourceFile, const char* des
 
 void Compress(const char* compressorName, const char* sourceFile, const char* destFile)
 {
-    DoAction(compressorName, sourceFile, destFile, compressLambda);
+    DoAction(compressorName, CompressorOptions(), sourceFile, destFile, compressLambda);
+}
+
+void Compress(const char* compressorName, const CompressorOptions& options, const char* sourceFile, const char* destFile)
+{
+    DoAction(compressorName, options, sourceFile, destFile, compressLambda);
 }
 
 void Decompress(const char* compressorName, const char* sourceFile, const char* destFile)
 {
-    DoAction(compressorName, sourceFile, destFile, decompressLambda);
+    DoAction(compressorName, CompressorOptions(), sourceFile, destFile, decompressLambda);
 }
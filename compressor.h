@@ -4,7 +4,7 @@
 
 #include <memory>
 
-std::shared_ptr<ICompressor> GetCompressor(const char* compressorName);
+std::shared_ptr<ICompressor> GetCompressor(const char* compressorName, const CompressorOptions& options = CompressorOptions());
 
 void Compress(ICompressor* compressor, const char* sourceFile, const char* destFile);
 
@@ -12,4 +12,6 @@ void Decompress(ICompressor* compressor, const char* sourceFile, const char* des
 
 void Compress(const char* compressorName, const char* sourceFile, const char* destFile);
 
+void Compress(const char* compressorName, const CompressorOptions& options, const char* sourceFile, const char* destFile);
+
 void Decompress(const char* compressorName, const char* sourceFile, const char* destFile);
@@ -0,0 +1,51 @@
+#include "format.h"
+#include <cassert>
+#include <exception>
+
+inline void check_true(bool expr)
+{
+    if (!expr) throw std::exception();
+}
+
+void WriteFormatHeader(ISequentialWriteStream& dest, unsigned char version)
+{
+    assert(LegacyFormatVersion < version);
+    
+    const unsigned char header[] =
+    {
+        static_cast<unsigned char>(FormatMagic & 0xFF),
+        static_cast<unsigned char>((FormatMagic >> 8) & 0xFF),
+        static_cast<unsigned char>((FormatMagic >> 16) & 0xFF),
+        static_cast<unsigned char>((FormatMagic >> 24) & 0xFF),
+        version
+    };
+    
+    check_true( dest.Write(header, sizeof(header)) == sizeof(header) );
+}
+
+bool ReadFormatHeader(ISequentialReadStream& source, unsigned char* version, uint32_t* head)
+{
+    assert(nullptr != version);
+    assert(nullptr != head);
+    
+    unsigned char b[4];
+    const size_t n = source.Read(b, sizeof(b));
+    if (0 == n)
+        return false;
+    
+    check_true( sizeof(b) == n );
+    
+    const uint32_t value = b[0] | (b[1] << 8) | (b[2] << 16) | (static_cast<uint32_t>(b[3]) << 24);
+    if (FormatMagic != value)
+    {
+        *version = LegacyFormatVersion;
+        *head = value;
+        return true;
+    }
+    
+    check_true( sizeof(*version) == source.Read(version, sizeof(*version)) );
+    check_true( LegacyFormatVersion < *version );
+    
+    *head = 0;
+    return true;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "istream.h"
+
+//
+// Compressed streams start with FormatMagic followed by a codec specific version byte.
+// Streams written before versioning start directly with codec data. Their first 32 bits
+// can not be FormatMagic for Huffman (a count of at most 256 codes), Lzw (a byte code) and
+// BitRle (a table whose min value 0xFF would be above its max value 0x43). For BitLzw they
+// are a count of codes, which matches FormatMagic only for a stream of exactly 0x504D43FF
+// (about 1.35G) codes, so a collision is practically impossible but not ruled out.
+//
+
+enum { FormatMagic = 0x504D43FF, LegacyFormatVersion = 1 };
+
+void WriteFormatHeader(ISequentialWriteStream& dest, unsigned char version);
+
+// Returns false if source is empty. For legacy streams returns LegacyFormatVersion
+// and the first 32 bits of codec data (already consumed from source) in *head.
+bool ReadFormatHeader(ISequentialReadStream& source, unsigned char* version, uint32_t* head);
@@ -0,0 +1,335 @@
+#include "fse.h"
+
+#include <cassert>
+#include <cstddef>
+#include <algorithm>
+
+//
+//
+//
+
+// position of the highest set bit, value must not be 0
+inline unsigned int HighBit(unsigned int value)
+{
+    assert(0 != value);
+    return CountBits(value) - 1;
+}
+
+unsigned int GetFseTableLog(uint64_t size)
+{
+    // 2^tableLog > size up to the limit, so the distinct values of a block always fit
+    unsigned int tableLog = FseMinTableLog;
+    while (tableLog < FseMaxTableLog && (size >> tableLog) != 0)
+        ++tableLog;
+    return tableLog;
+}
+
+std::vector<unsigned int> NormalizeFseCounts(const std::vector<uint64_t>& counts, unsigned int tableLog)
+{
+    assert(ByteTypeCountValues == counts.size());
+    assert(FseMinTableLog <= tableLog && tableLog <= FseMaxTableLog);
+    
+    const unsigned int tableSize = 1u << tableLog;
+    
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < ByteTypeCountValues; ++i)
+    {
+        total += counts[i];
+    }
+    
+    std::vector<unsigned int> normalized(ByteTypeCountValues, 0);
+    if (0 == total)
+        return normalized;
+    
+    // rounded shares of the table, a present value takes a state at least
+    unsigned int sum = 0;
+    for (unsigned int i = 0; i < ByteTypeCountValues; ++i)
+    {
+        if (0 == counts[i])
+            continue;
+        
+        const uint64_t share = (counts[i] * tableSize + total / 2) / total;
+        normalized[i] = std::max(static_cast<unsigned int>(share), 1u);
+        sum += normalized[i];
+    }
+    
+    // rounding errors go to the largest shares, where a state more or less costs the least
+    while (sum != tableSize)
+    {
+        unsigned int best = ByteTypeCountValues;
+        for (unsigned int i = 0; i < ByteTypeCountValues; ++i)
+        {
+            if (sum > tableSize ? (normalized[i] > 1) : (0 != counts[i]))
+            {
+                if (ByteTypeCountValues == best || normalized[i] > normalized[best])
+                    best = i;
+            }
+        }
+        assert(ByteTypeCountValues != best);
+        
+        if (sum > tableSize)
+        {
+            --normalized[best];
+            --sum;
+        }
+        else
+        {
+            ++normalized[best];
+            ++sum;
+        }
+    }
+    
+    return normalized;
+}
+
+// Values of the states: the states of a value are spread over the table by an odd step,
+// so that a value's next states are not clustered
+static std::vector<unsigned char> SpreadValues(const std::vector<unsigned int>& normalized, unsigned int tableLog)
+{
+    const unsigned int tableSize = 1u << tableLog;
+    const unsigned int mask = tableSize - 1;
+    const unsigned int step = (tableSize >> 1) + (tableSize >> 3) + 3;
+    
+    std::vector<unsigned char> values(tableSize);
+    
+    unsigned int pos = 0;
+    for (unsigned int i = 0; i < ByteTypeCountValues; ++i)
+    {
+        for (unsigned int k = 0; k < normalized[i]; ++k)
+        {
+            values[pos] = static_cast<unsigned char>(i);
+            pos = (pos + step) & mask;
+        }
+    }
+    assert(0 == pos);
+    
+    return values;
+}
+
+//
+//
+//
+
+FseEncoder::FseEncoder(const std::vector<unsigned int>& normalized, unsigned int tableLog)
+: m_states(static_cast<size_t>(1) << tableLog)
+, m_tableLog(tableLog)
+{
+    assert(ByteTypeCountValues == normalized.size());
+    assert(FseMinTableLog <= tableLog && tableLog <= FseMaxTableLog);
+    
+    const unsigned int tableSize = 1u << tableLog;
+    const std::vector<unsigned char> values = SpreadValues(normalized, tableLog);
+    
+    // states of a value are consecutive in m_states, in the order of the table
+    unsigned int starts[ByteTypeCountValues];
+    unsigned int next[ByteTypeCountValues];
+    for (unsigned int i = 0, start = 0; i < ByteTypeCountValues; ++i)
+    {
+        starts[i] = next[i] = start;
+        start += normalized[i];
+    }
+    
+    for (unsigned int u = 0; u < tableSize; ++u)
+    {
+        m_states[next[values[u]]++] = static_cast<uint16_t>(tableSize + u);
+    }
+    
+    // a value of count n moves a state of [tableSize, 2 * tableSize) to [n, 2 * n) by dropping
+    // maxBits or maxBits - 1 bits, the next state is the one of that sub-state
+    for (unsigned int i = 0; i < ByteTypeCountValues; ++i)
+    {
+        FseTransform& t = m_transforms[i];
+        const unsigned int n = normalized[i];
+        if (0 == n)
+        {
+            t.deltaBits = 0;
+            t.deltaState = 0;
+            continue;
+        }
+        
+        const unsigned int maxBits = tableLog - ((n > 1) ? HighBit(n - 1) : 0);
+        t.deltaBits = (maxBits << 16) - (n << maxBits);
+        t.deltaState = static_cast<int32_t>(starts[i]) - static_cast<int32_t>(n);
+    }
+}
+
+// Moves state by value t, returns the bits to write in *value and their count
+static inline unsigned int EncodeValue(uint32_t& state, const uint16_t* states, const FseTransform& t, uint64_t* value)
+{
+    const unsigned int bits = (state + t.deltaBits) >> 16;
+    *value = state & LowBitsMask(bits);
+    state = states[static_cast<int32_t>(state >> bits) + t.deltaState];
+    return bits;
+}
+
+void FseEncoder::Encode(BitStreamWriter& w, const unsigned char* data, size_t size) const
+{
+    assert(nullptr != data || 0 == size);
+    static_assert(4 == FseStates, "encoding is unrolled for 4 states");
+    
+    const uint16_t* const states = m_states.data();
+    const FseTransform* const transforms = m_transforms;
+    const uint32_t tableSize = 1u << m_tableLog;
+    
+    // value i goes with state i % FseStates, so the decoder follows independent chains
+    uint32_t state[FseStates] = { tableSize, tableSize, tableSize, tableSize };
+    
+    size_t i = size;
+    for (; 0 != (i % FseStates); --i)
+    {
+        uint64_t value = 0;
+        const unsigned int bits = EncodeValue(state[(i - 1) % FseStates], states, transforms[data[i - 1]], &value);
+        w.WriteBits(value, bits);
+    }
+    
+    uint32_t state0 = state[0];
+    uint32_t state1 = state[1];
+    uint32_t state2 = state[2];
+    uint32_t state3 = state[3];
+    
+    // the codes of 4 values take up to 4 * FseMaxTableLog bits, a single write
+    while (i > 0)
+    {
+        i -= FseStates;
+        
+        uint64_t value0 = 0, value1 = 0, value2 = 0, value3 = 0;
+        const unsigned int bits3 = EncodeValue(state3, states, transforms[data[i + 3]], &value3);
+        const unsigned int bits2 = EncodeValue(state2, states, transforms[data[i + 2]], &value2);
+        const unsigned int bits1 = EncodeValue(state1, states, transforms[data[i + 1]], &value1);
+        const unsigned int bits0 = EncodeValue(state0, states, transforms[data[i]], &value0);
+        
+        const unsigned int bits32 = bits3 + bits2;
+        const unsigned int bits321 = bits32 + bits1;
+        w.WriteBits(value3 | (value2 << bits3) | (value1 << bits32) | (value0 << bits321), bits321 + bits0);
+    }
+    
+    w.WriteBits(state3 - tableSize, m_tableLog);
+    w.WriteBits(state2 - tableSize, m_tableLog);
+    w.WriteBits(state1 - tableSize, m_tableLog);
+    w.WriteBits(state0 - tableSize, m_tableLog);
+    w.WriteBits(1, 1);
+}
+
+//
+//
+//
+
+FseDecoder::FseDecoder(const std::vector<unsigned int>& normalized, unsigned int tableLog)
+: m_table(static_cast<size_t>(1) << tableLog)
+, m_tableLog(tableLog)
+{
+    assert(ByteTypeCountValues == normalized.size());
+    assert(FseMinTableLog <= tableLog && tableLog <= FseMaxTableLog);
+    
+    const unsigned int tableSize = 1u << tableLog;
+    const std::vector<unsigned char> values = SpreadValues(normalized, tableLog);
+    
+    // the k-th state of a value of count n in the table is the encoder's sub-state n + k
+    unsigned int next[ByteTypeCountValues];
+    std::copy(normalized.begin(), normalized.end(), next);
+    
+    for (unsigned int u = 0; u < tableSize; ++u)
+    {
+        Entry& e = m_table[u];
+        const unsigned int x = next[values[u]]++;
+        const unsigned int bits = tableLog - HighBit(x);
+        
+        e.value = values[u];
+        e.bits = static_cast<unsigned char>(bits);
+        e.state = static_cast<uint16_t>((x << bits) - tableSize);
+    }
+}
+
+// Reads bits of a payload from its end towards the start, the last bits written come first
+struct BackwardBitReader
+{
+    const unsigned char* data;
+    ptrdiff_t pos;    // count of bits left
+    uint64_t window;  // 64 bits of data ending at or above pos, loaded by Load
+    ptrdiff_t base;   // position of the first bit of window
+    
+    uint64_t Read(unsigned int countBits)
+    {
+        pos -= countBits;
+        return (LoadLE64(data + (pos >> 3)) >> (pos & 7)) & LowBitsMask(countBits);
+    }
+    
+    // the window holds 56 to 63 bits below pos, so a read of 0 bits does not shift it by 64,
+    // pos must be 56 at least
+    void Load()
+    {
+        const ptrdiff_t k = (pos >> 3) - 7;
+        window = LoadLE64(data + k);
+        base = k * BitsPerByte;
+    }
+    
+    uint64_t ReadWindow(unsigned int countBits)
+    {
+        pos -= countBits;
+        return (window >> (pos - base)) & LowBitsMask(countBits);
+    }
+};
+
+bool FseDecoder::Decode(const unsigned char* data, size_t size, unsigned char* out, size_t count) const
+{
+    assert(nullptr != data);
+    assert(nullptr != out || 0 == count);
+    static_assert(4 == FseStates, "decoding is unrolled for 4 states");
+    
+    // the last byte holds the end mark
+    if (0 == size || 0 == data[size - 1])
+        return false;
+    
+    BackwardBitReader r;
+    r.data = data;
+    r.pos = static_cast<ptrdiff_t>(size - 1) * BitsPerByte + HighBit(data[size - 1]);
+    
+    const ptrdiff_t groupBits = FseStates * static_cast<ptrdiff_t>(m_tableLog);
+    if (r.pos < groupBits)
+        return false;
+    
+    uint32_t state0 = static_cast<uint32_t>(r.Read(m_tableLog));
+    uint32_t state1 = static_cast<uint32_t>(r.Read(m_tableLog));
+    uint32_t state2 = static_cast<uint32_t>(r.Read(m_tableLog));
+    uint32_t state3 = static_cast<uint32_t>(r.Read(m_tableLog));
+    
+    const Entry* const table = m_table.data();
+    
+    // a value takes up to m_tableLog bits, so a window holds the bits of a group
+    static_assert(FseStates * FseMaxTableLog <= 56, "a group of values is read from a single window");
+    
+    size_t i = 0;
+    for (; (i + FseStates) <= count && r.pos >= 64; i += FseStates)
+    {
+        r.Load();
+        
+        const Entry& e0 = table[state0];
+        const Entry& e1 = table[state1];
+        const Entry& e2 = table[state2];
+        const Entry& e3 = table[state3];
+        
+        out[i] = e0.value;
+        out[i + 1] = e1.value;
+        out[i + 2] = e2.value;
+        out[i + 3] = e3.value;
+        
+        state0 = e0.state + static_cast<uint32_t>(r.ReadWindow(e0.bits));
+        state1 = e1.state + static_cast<uint32_t>(r.ReadWindow(e1.bits));
+        state2 = e2.state + static_cast<uint32_t>(r.ReadWindow(e2.bits));
+        state3 = e3.state + static_cast<uint32_t>(r.ReadWindow(e3.bits));
+    }
+    
+    uint32_t state[FseStates] = { state0, state1, state2, state3 };
+    for (; i < count; ++i)
+    {
+        const Entry& e = table[state[i % FseStates]];
+        if (r.pos < e.bits)
+            return false;
+        
+        out[i] = e.value;
+        state[i % FseStates] = e.state + static_cast<uint32_t>(r.Read(e.bits));
+    }
+    
+    // the encoder starts all chains from the first state
+    return 0 == r.pos && 0 == (state[0] | state[1] | state[2] | state[3]);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "common.h"
+#include "bitstream.h"
+#include "huffman.h"
+
+//
+// Table-based asymmetric numeral systems (tANS, FSE): byte values are coded with a state machine of
+// 2^tableLog states, built from counts of the values normalized to a sum of 2^tableLog. A value costs
+// close to its information content, fractions of a bit included, with a table lookup per value.
+//
+
+enum { FseMinTableLog = 5, FseMaxTableLog = 12 };
+
+// independent state chains of a payload, value i is coded with state i % FseStates
+enum { FseStates = 4 };
+
+// readable bytes past the end of a payload for the decoding
+enum { FsePadding = 8 };
+
+// Table log for a block of size values, the table has a state for every distinct value at least
+unsigned int GetFseTableLog(uint64_t size);
+
+// Counts of all byte values scaled to a sum of 2^tableLog, every value present in counts keeps a non-zero count.
+// There must be at most 2^tableLog distinct values.
+std::vector<unsigned int> NormalizeFseCounts(const std::vector<uint64_t>& counts, unsigned int tableLog);
+
+//
+//
+//
+
+struct FseTransform
+{
+    uint32_t deltaBits;  // count of bits to write is (state + deltaBits) >> 16
+    int32_t deltaState;  // offset of the next states of a value in the encoder's states
+};
+
+class FseEncoder
+{
+public:
+    // normalized holds counts of all byte values summing to 2^tableLog
+    FseEncoder(const std::vector<unsigned int>& normalized, unsigned int tableLog);
+    
+    // Writes the codes of data from its last value back to the first, then the final states and a set bit
+    // that marks the end of the payload. The payload is read backwards from that bit by FseDecoder.
+    void Encode(BitStreamWriter& w, const unsigned char* data, size_t size) const;
+    
+private:
+    FseEncoder(const FseEncoder&);
+    FseEncoder& operator=(const FseEncoder&);
+    
+    std::vector<uint16_t> m_states;
+    FseTransform m_transforms[ByteTypeCountValues];
+    unsigned int m_tableLog;
+};
+
+//
+//
+//
+
+class FseDecoder
+{
+public:
+    FseDecoder(const std::vector<unsigned int>& normalized, unsigned int tableLog);
+    
+    // Decodes count values of an FseEncoder payload in memory followed by FsePadding readable bytes.
+    // Returns false if the payload does not hold exactly count values.
+    bool Decode(const unsigned char* data, size_t size, unsigned char* out, size_t count) const;
+    
+private:
+    FseDecoder(const FseDecoder&);
+    FseDecoder& operator=(const FseDecoder&);
+    
+    struct Entry
+    {
+        uint16_t state;      // next state less the bits read
+        unsigned char value;
+        unsigned char bits;  // count of bits to read
+    };
+    
+    std::vector<Entry> m_table;
+    unsigned int m_tableLog;
+};
@@ -0,0 +1,245 @@
+#include "fsecompressor.h"
+#include "fse.h"
+#include "huffman.h"
+#include "streamimpl.h"
+#include "bitstream.h"
+#include "format.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+enum { FseFormatVersion = 2 };
+
+// blocks are decoded in one piece, larger ones are split
+enum { FseMaxBlockSize = 1 << 26 };
+
+// "more" bytes of the blocks
+enum { FseCodedBlock = 1, FseStoredBlock = 2 };
+
+inline void check_true(bool expr)
+{
+    if (!expr) throw std::exception();
+}
+
+// Normalized counts: 3 bits of the table log minus FseMinTableLog, then counts of byte values in order until they
+// sum to 2^tableLog. A count takes the bit count of the rest of the sum, a zero count is followed by a flag,
+// a set flag is followed by 8 bits of the length minus 2 of the run of zero counts it starts.
+static void CompressFseCounts(BitStreamWriter& w, const std::vector<unsigned int>& normalized, unsigned int tableLog)
+{
+    w.WriteBits(tableLog - FseMinTableLog, 3);
+    
+    unsigned int rest = 1u << tableLog;
+    for (unsigned int i = 0; 0 != rest;)
+    {
+        assert(i < ByteTypeCountValues);
+        
+        const unsigned int count = normalized[i];
+        w.WriteBits(count, CountBits(rest));
+        
+        if (0 != count)
+        {
+            rest -= count;
+            ++i;
+            continue;
+        }
+        
+        unsigned int run = 1;
+        while ((i + run) < ByteTypeCountValues && 0 == normalized[i + run])
+            ++run;
+        
+        w.WriteBits((run > 1) ? 1 : 0, 1);
+        if (run > 1)
+            w.WriteBits(run - 2, 8);
+        
+        i += run;
+    }
+}
+
+static unsigned int DecompressFseCounts(BitStreamReader& r, std::vector<unsigned int>& normalized)
+{
+    const unsigned int tableLog = static_cast<unsigned int>(r.ReadBits(3)) + FseMinTableLog;
+    check_true( tableLog <= FseMaxTableLog );
+    
+    normalized.assign(ByteTypeCountValues, 0);
+    
+    unsigned int rest = 1u << tableLog;
+    for (unsigned int i = 0; 0 != rest;)
+    {
+        check_true( i < ByteTypeCountValues );
+        
+        const unsigned int count = static_cast<unsigned int>(r.ReadBits(CountBits(rest)));
+        check_true( count <= rest );
+        
+        if (0 != count)
+        {
+            normalized[i++] = count;
+            rest -= count;
+            continue;
+        }
+        
+        const unsigned int run = (0 != r.ReadBits(1)) ? static_cast<unsigned int>(r.ReadBits(8)) + 2 : 1;
+        i += run;
+    }
+    
+    check_true( !r.IsOverrun() );
+    return tableLog;
+}
+
+// Sizes: 6 bits of their bit count minus 1, then the value itself
+static void CompressFseSize(BitStreamWriter& w, uint64_t size)
+{
+    unsigned int n = 1;
+    while (0 != (size >> n) && n < 64)
+        ++n;
+    
+    w.WriteBits(n - 1, 6);
+    w.WriteBits(size, n);
+}
+
+static uint64_t DecompressFseSize(BitStreamReader& r)
+{
+    const unsigned int n = static_cast<unsigned int>(r.ReadBits(6)) + 1;
+    return r.ReadBits(n);
+}
+
+// Coded block: "more" byte FseCodedBlock, normalized counts, the count of values and the byte size of the payload,
+// then the payload from a byte boundary. Stored block: "more" byte FseStoredBlock and the size, then the data
+// from a byte boundary. Data that does not get smaller is stored.
+static void CompressFseBlock(BitStreamWriter& w, HuffmanScanner& scanner, const unsigned char* data, size_t size)
+{
+    std::vector<uint64_t> counts;
+    scanner.BeginScan();
+    scanner.Scan(data, size);
+    scanner.EndScan(counts);
+    
+    const unsigned int tableLog = GetFseTableLog(size);
+    const std::vector<unsigned int> normalized = NormalizeFseCounts(counts, tableLog);
+    
+    std::vector<unsigned char> payload;
+    {
+        ByteArraySequentialWriteStream stream(&payload);
+        BitStreamWriter pw(&stream);
+        FseEncoder(normalized, tableLog).Encode(pw, data, size);
+        check_true( pw.CompleteByte() );
+    }
+    
+    if (payload.size() < size)
+    {
+        const unsigned char more = FseCodedBlock;
+        check_true( w.WriteBits(more) );
+        
+        CompressFseCounts(w, normalized, tableLog);
+        CompressFseSize(w, size);
+        CompressFseSize(w, payload.size());
+        check_true( w.CompleteByte() );
+        check_true( w.WriteBytes(payload.data(), payload.size()) );
+    }
+    else
+    {
+        const unsigned char more = FseStoredBlock;
+        check_true( w.WriteBits(more) );
+        
+        CompressFseSize(w, size);
+        check_true( w.CompleteByte() );
+        check_true( w.WriteBytes(data, size) );
+    }
+    
+    check_true( w.CompleteByte() );
+}
+
+// Reads a coded block after its "more" byte
+static void DecompressFseBlock(BitStreamReader& r, ZeroCopyWriter& writer)
+{
+    std::vector<unsigned int> normalized;
+    const unsigned int tableLog = DecompressFseCounts(r, normalized);
+    
+    const uint64_t count = DecompressFseSize(r);
+    const uint64_t size = DecompressFseSize(r);
+    
+    // a value takes up to tableLog bits, the FseStates final states and the end mark bit follow them
+    check_true( count <= FseMaxBlockSize );
+    check_true( size <= ((count + FseStates) * tableLog + 1 + BitsPerByte - 1) / BitsPerByte );
+    
+    r.AlignToByte();
+    
+    std::vector<unsigned char> payload(static_cast<size_t>(size) + FsePadding);
+    check_true( r.ReadBytes(payload.data(), static_cast<size_t>(size)) );
+    
+    const FseDecoder decoder(normalized, tableLog);
+    
+    unsigned char* out = writer.Reserve(static_cast<size_t>(count));
+    check_true( decoder.Decode(payload.data(), static_cast<size_t>(size), out, static_cast<size_t>(count)) );
+    writer.Commit(static_cast<size_t>(count));
+}
+
+// Reads a stored block after its "more" byte
+static void DecompressFseStoredBlock(BitStreamReader& r, ZeroCopyWriter& writer)
+{
+    const uint64_t size = DecompressFseSize(r);
+    check_true( size <= FseMaxBlockSize );
+    
+    r.AlignToByte();
+    
+    unsigned char* out = writer.Reserve(static_cast<size_t>(size));
+    check_true( r.ReadBytes(out, static_cast<size_t>(size)) );
+    writer.Commit(static_cast<size_t>(size));
+}
+
+//
+//
+//
+
+Fse::Fse(const CompressorOptions& options)
+: m_blockSize(options.blockSize)
+{
+}
+
+void Fse::Compress(IReadStream& source, ISequentialWriteStream& dest)
+{
+    const size_t blockSize = (0 != m_blockSize) ? std::min(m_blockSize, static_cast<size_t>(FseMaxBlockSize)) : DefaultBlockSize;
+    
+    WriteFormatHeader(dest, FseFormatVersion);
+    
+    BitStreamWriter w(&dest);
+    HuffmanScanner scanner;
+    
+    ForEachBlock(source, blockSize, [&](const unsigned char* data, size_t n)
+    {
+        CompressFseBlock(w, scanner, data, n);
+    });
+    
+    const unsigned char more = 0;
+    check_true( w.WriteBits(more) );
+    check_true( w.CompleteByte() );
+}
+
+void Fse::Decompress(ISequentialReadStream& source, ISequentialWriteStream& dest)
+{
+    unsigned char version = 0;
+    uint32_t head = 0;
+    check_true( ReadFormatHeader(source, &version, &head) );
+    check_true( FseFormatVersion == version );
+    
+    BitStreamReader r(&source);
+    ZeroCopyWriter writer(&dest);
+    
+    for (;;)
+    {
+        unsigned char more = 0;
+        check_true( r.ReadBits(&more) );
+        if (0 == more)
+            break;
+        
+        if (FseCodedBlock == more)
+        {
+            DecompressFseBlock(r, writer);
+        }
+        else
+        {
+            check_true( FseStoredBlock == more );
+            DecompressFseStoredBlock(r, writer);
+        }
+    }
+    
+    writer.Flush();
+}
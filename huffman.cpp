@@ -1,65 +1,18 @@
 #include "huffman.h"
 
 #include <cassert>
-#include <stack>
+#include <cstddef>
 #include <algorithm>
+#include <map>
 
 //
 //
 //
 
-enum { BitLeft = 1, BitRight = 0 };
-
-//
-//
-//
-
-static const CodeLength ZeroCodeLength;
-
-//
-//
-//
-
-HuffmanCodeTable::HuffmanCodeTable()
-: m_codes(ByteTypeCountValues)
-{}
-
-HuffmanCodeTable::HuffmanCodeTable(std::unordered_map<unsigned char, CodeLength>&& codes)
-: m_codes(std::move(codes))
+HuffmanCodeTable::HuffmanCodeTable(unsigned int countValues)
+: m_codes(countValues)
 {
-}
-
-HuffmanCodeTable::HuffmanCodeTable(HuffmanCodeTable&& other)
-: m_codes(std::move(other.m_codes))
-{
-}
-
-HuffmanCodeTable::HuffmanCodeTable(const HuffmanCodeTable& other)
-: m_codes(other.m_codes)
-{}
-
-HuffmanCodeTable& HuffmanCodeTable::operator=(HuffmanCodeTable&& other)
-{
-    m_codes = std::move(other.m_codes);
-    return *this;
-}
-
-HuffmanCodeTable& HuffmanCodeTable::operator=(const HuffmanCodeTable& other)
-{
-    m_codes = other.m_codes;
-    return *this;
-}
-
-void HuffmanCodeTable::SetCodeLength(unsigned char b, const CodeLength& codeLength)
-{
-    m_codes[b] = codeLength;
-}
-
-const CodeLength& HuffmanCodeTable::GetCodeLength(unsigned char b) const
-{
-    auto i = m_codes.find(b);
-    if (m_codes.end() == i) return ZeroCodeLength;
-    else return i->second;
+    assert(0 != countValues && countValues <= (1u << HuffmanMaxValueBits));
 }
 
 void HuffmanCodeTable::swap(HuffmanCodeTable& other)
@@ -71,42 +24,79 @@ void HuffmanCodeTable::swap(HuffmanCodeTable& other)
 //
 //
 
-HuffmanScanner::HuffmanScanner()
+HuffmanScanner::HuffmanScanner(unsigned int maxCodeLength, unsigned int countValues)
 : m_state(state_none)
-, m_bytes(ByteTypeCountValues)
+, m_counts(ScanTables * static_cast<size_t>(countValues))
+, m_bytes(countValues)
 , m_count(0)
-{}
+, m_maxCodeLength(maxCodeLength)
+, m_countValues(countValues)
+{
+    assert(HuffmanMinCodeLengthLimit <= maxCodeLength && maxCodeLength <= HuffmanMaxCodeLength);
+    assert(0 != countValues && countValues <= (1u << HuffmanMaxValueBits));
+    assert((static_cast<uint64_t>(1) << maxCodeLength) >= countValues);
+}
 
 void HuffmanScanner::BeginScan()
 {
     assert(state_none == m_state);
     
-    if (0 != m_count)
-    {
-        std::fill(m_bytes.begin(), m_bytes.end(), 0);
-        m_count = 0;
-    }
+    std::fill(m_counts.begin(), m_counts.end(), 0);
     
     m_state = state_scanning;
 }
 
-void HuffmanScanner::Scan(unsigned char b)
+void HuffmanScanner::Scan(unsigned int value)
 {
     assert(state_scanning == m_state);
+    assert(value < m_countValues);
+    
+    m_counts[value] += 1;
+}
+
+void HuffmanScanner::Scan(const unsigned char* data, size_t size)
+{
+    assert(state_scanning == m_state);
+    assert(nullptr != data || 0 == size);
+    assert(ByteTypeCountValues <= m_countValues);
+    
+    // consecutive bytes go to different tables, so repeated bytes do not wait for each other's increments
+    uint64_t* const c0 = m_counts.data();
+    uint64_t* const c1 = c0 + m_countValues;
+    uint64_t* const c2 = c1 + m_countValues;
+    uint64_t* const c3 = c2 + m_countValues;
     
-    if (0 == m_bytes[b]) m_count += 1;
-    m_bytes[b] += 1;
+    size_t i = 0;
+    for (; (i + 8) <= size; i += 8)
+    {
+        const uint64_t v = LoadLE64(data + i);
+        ++c0[v & 0xFF];
+        ++c1[(v >> 8) & 0xFF];
+        ++c2[(v >> 16) & 0xFF];
+        ++c3[(v >> 24) & 0xFF];
+        ++c0[(v >> 32) & 0xFF];
+        ++c1[(v >> 40) & 0xFF];
+        ++c2[(v >> 48) & 0xFF];
+        ++c3[v >> 56];
+    }
+    
+    for (; i < size; ++i)
+    {
+        ++c0[data[i]];
+    }
 }
 
-void HuffmanScanner::EndScan(HuffmanCodeTable& table, unsigned int& totalLen)
+void HuffmanScanner::EndScan(HuffmanCodeTable& table, uint64_t& totalLen)
 {
     assert(state_scanning == m_state);
     
     m_state = state_none;
     
+    MergeCounts();
+    
     if (m_count == 0)
     {
-        table = HuffmanCodeTable();
+        table = HuffmanCodeTable(m_countValues);
         totalLen = 0;
     }
     else
@@ -114,206 +104,516 @@ void HuffmanScanner::EndScan(HuffmanCodeTable& table, unsigned int& totalLen)
         table = BuildCodesTable();
         
         totalLen = 0;
-        for (unsigned int i = 0; i < ByteTypeCountValues; ++i)
+        for (unsigned int i = 0; i < m_countValues; ++i)
         {
             if (0 != m_bytes[i])
             {
-                const CodeLength& codeLen = table.GetCodeLength(static_cast<unsigned char>(i));
+                const CodeLength& codeLen = table.GetCodeLength(i);
                 totalLen += m_bytes[i] * codeLen.length;
             }
         }
     }
 }
 
+void HuffmanScanner::EndScan(std::vector<uint64_t>& counts)
+{
+    assert(state_scanning == m_state);
+    
+    m_state = state_none;
+    
+    MergeCounts();
+    counts = m_bytes;
+}
+
+void HuffmanScanner::MergeCounts()
+{
+    m_count = 0;
+    for (unsigned int i = 0; i < m_countValues; ++i)
+    {
+        uint64_t count = 0;
+        for (unsigned int t = 0; t < ScanTables; ++t)
+        {
+            count += m_counts[t * static_cast<size_t>(m_countValues) + i];
+        }
+        
+        m_bytes[i] = count;
+        if (0 != count) m_count += 1;
+    }
+}
+
+// Leaves are nodes [0, count of values) sorted by count, merged nodes follow them in the order of creation
 struct HuffmanScanner::Node
 {
-    Node(unsigned int c = 0, unsigned char b = 0) : left(nullptr), right(nullptr), value(b), count(c) {}
-    Node* left;
-    Node* right;
-    unsigned char value;
-    unsigned int count;
+    Node(uint64_t c, unsigned int v) : count(c), left(0), right(0), value(v) {}
+    Node(uint64_t c, unsigned int l, unsigned int r) : count(c), left(l), right(r), value(0) {}
+    uint64_t count;
+    unsigned int left;
+    unsigned int right;
+    unsigned int value;
 };
 
 HuffmanCodeTable HuffmanScanner::BuildCodesTable() const
 {
     assert(m_count != 0);
     
-    ObjectStorage<Node> storage;
+    std::vector<Node> nodes;
+    BuildTree(nodes);
     
-    Node* root = BuildTree(storage);
+    std::vector<unsigned int> lengths = BuildCodeLengthsFromTree(nodes);
+    LimitCodeLengths(lengths);
     
-    return BuildCodesTableFromTree(root);
+    return MakeCanonicalCodesTable(lengths);
 }
 
-HuffmanScanner::Node* HuffmanScanner::BuildTree(ObjectStorage<Node>& storage) const
+// Two-queue construction: merged nodes are created in non-decreasing order of counts, so the two smallest
+// nodes are always at the heads of the sorted leaves and of the merged nodes
+void HuffmanScanner::BuildTree(std::vector<Node>& nodes) const
 {
-    std::vector<Node*> v;
-    v.reserve(m_count);
+    nodes.clear();
+    nodes.reserve(2 * m_count - 1);
     
-    for (size_t i = 0, n = m_bytes.size(); i < n; ++i)
+    for (unsigned int i = 0; i < m_countValues; ++i)
     {
         if (0 != m_bytes[i])
         {
-            Node* n = storage.NewObject(m_bytes[i], i);
-            v.push_back(n);
+            nodes.push_back(Node(m_bytes[i], i));
         }
     }
     
-    std::sort(v.begin(), v.end(), [](const Node* a, const Node* b) { return a->count < b->count; });
+    std::stable_sort(nodes.begin(), nodes.end(), [](const Node& a, const Node& b) { return a.count < b.count; });
     
-    for (size_t i = 0; i < (v.size() - 1);)
-    {
-        Node* min = storage.NewObject(v[i]->count + v[i + 1]->count);
-        min->left = v[i];
-        min->right = v[i + 1];
-        v[i] = nullptr;
-        v[i + 1] = min;
-        ++i;
-        for (size_t j = i; (j < (v.size() - 1)) && (v[j]->count >= v[j + 1]->count); ++j)
-        {
-            std::swap(v[j], v[j + 1]);
-        }
-    }
+    const unsigned int leaves = static_cast<unsigned int>(nodes.size());
+    unsigned int leaf = 0;
+    unsigned int merged = leaves;
     
-    Node* root = v[v.size() - 1];
+    // a leaf goes first on equal counts, it keeps the tree shallower
+    auto takeMin = [&]()
+    {
+        if (leaf < leaves && (merged == nodes.size() || nodes[leaf].count <= nodes[merged].count))
+            return leaf++;
+        return merged++;
+    };
     
-    return root;
+    while (nodes.size() < (2 * static_cast<size_t>(leaves) - 1))
+    {
+        const unsigned int l = takeMin();
+        const unsigned int r = takeMin();
+        nodes.push_back(Node(nodes[l].count + nodes[r].count, l, r));
+    }
 }
 
-struct HuffmanScanner::NodeCodeLength
+std::vector<unsigned int> HuffmanScanner::BuildCodeLengthsFromTree(const std::vector<Node>& nodes) const
 {
-    Node* node;
-    unsigned int len;
-    unsigned int code;
-};
+    const unsigned int leaves = (static_cast<unsigned int>(nodes.size()) + 1) / 2;
+    
+    // the root is the last node, children of a merged node precede it
+    std::vector<unsigned int> depths(nodes.size());
+    for (size_t i = nodes.size() - 1; i >= leaves; --i)
+    {
+        depths[nodes[i].left] = depths[i] + 1;
+        depths[nodes[i].right] = depths[i] + 1;
+    }
+    
+    std::vector<unsigned int> lengths(m_countValues);
+    for (unsigned int i = 0; i < leaves; ++i)
+    {
+        // a single value is the root itself, its code still takes a bit
+        lengths[nodes[i].value] = std::max(depths[i], 1u);
+    }
+    
+    return lengths;
+}
 
-HuffmanCodeTable HuffmanScanner::BuildCodesTableFromTree(Node* root) const
+// Codes longer than the limit are cut to it, then codes of the limit length are dropped and codes of
+// shorter lengths split until the Kraft sum is 1 again. The resulting lengths are handed out to values
+// by descending frequency.
+void HuffmanScanner::LimitCodeLengths(std::vector<unsigned int>& lengths) const
 {
-    std::unordered_map<unsigned char, CodeLength> codes;
-    codes.reserve(m_count);
+    const unsigned int limit = m_maxCodeLength;
     
-    std::stack<NodeCodeLength> s;
+    if (*std::max_element(lengths.begin(), lengths.end()) <= limit)
+        return;
     
-    NodeCodeLength n;
-    n.node = root;
-    n.len = 0;
-    n.code = 0;
-    s.push(n);
+    std::vector<unsigned int> counts(limit + 1);
+    std::vector<unsigned int> values;
+    values.reserve(m_count);
     
-    while (!s.empty())
+    for (unsigned int i = 0; i < m_countValues; ++i)
     {
-        NodeCodeLength n = s.top();
-        s.pop();
-        if (nullptr != n.node->left)
+        if (0 != lengths[i])
         {
-            NodeCodeLength l;
-            l.node = n.node->left;
-            l.len = n.len + 1;
-            l.code = n.code | (BitLeft << n.len);
-            s.push(l);
+            ++counts[std::min(lengths[i], limit)];
+            values.push_back(i);
         }
-        if (nullptr != n.node->right)
+    }
+    
+    // Kraft sum scaled by 2^limit
+    uint64_t total = 0;
+    for (unsigned int len = 1; len <= limit; ++len)
+    {
+        total += static_cast<uint64_t>(counts[len]) << (limit - len);
+    }
+    
+    const uint64_t full = static_cast<uint64_t>(1) << limit;
+    while (total > full)
+    {
+        // drops a code of the limit length and splits a shorter code in two, the sum falls by one
+        --counts[limit];
+        for (unsigned int len = limit - 1; len > 0; --len)
         {
-            NodeCodeLength r;
-            r.node = n.node->right;
-            r.len = n.len + 1;
-            r.code = n.code | (BitRight << n.len);
-            s.push(r);
+            if (0 != counts[len])
+            {
+                --counts[len];
+                counts[len + 1] += 2;
+                break;
+            }
         }
-        if (nullptr == n.node->left && nullptr == n.node->right)
+        --total;
+    }
+    
+    std::stable_sort(values.begin(), values.end(), [this](unsigned int a, unsigned int b) { return m_bytes[a] > m_bytes[b]; });
+    
+    auto v = values.begin();
+    for (unsigned int len = 1; len <= limit; ++len)
+    {
+        for (unsigned int i = 0; i < counts[len]; ++i)
         {
-            assert(ZeroCodeLength == codes[n.node->value]);
-            assert(n.len > 0);
-            codes[n.node->value] = CodeLength(n.code, n.len);
+            lengths[*v++] = len;
         }
     }
-    
-    return HuffmanCodeTable(std::move(codes));
+    assert(values.end() == v);
 }
 
 //
 //
 //
 
-HuffmanReader::HuffmanReader(const HuffmanCodeTable& codes)
-: m_root(nullptr)
-, m_current(nullptr)
+static unsigned int ReverseBits(unsigned int value, unsigned int countBits)
+{
+    unsigned int res = 0;
+    for (unsigned int i = 0; i < countBits; ++i, value >>= 1)
+    {
+        res = (res << 1) | (value & 1);
+    }
+    return res;
+}
+
+HuffmanCodeTable MakeCanonicalCodesTable(const std::vector<unsigned int>& lengths)
+{
+    const unsigned int countValues = static_cast<unsigned int>(lengths.size());
+    
+    unsigned int counts[HuffmanMaxCodeLength + 1] = {};
+    for (unsigned int len : lengths)
+    {
+        assert(len <= HuffmanMaxCodeLength);
+        ++counts[len];
+    }
+    counts[0] = 0;
+    
+    // first code of each length, codes of a length follow the codes of shorter lengths
+    uint64_t nextCodes[HuffmanMaxCodeLength + 1] = {};
+    uint64_t code = 0;
+    for (unsigned int len = 1; len <= HuffmanMaxCodeLength; ++len)
+    {
+        code = (code + counts[len - 1]) << 1;
+        nextCodes[len] = code;
+    }
+    
+    HuffmanCodeTable codes(countValues);
+    for (unsigned int i = 0; i < countValues; ++i)
+    {
+        const unsigned int len = lengths[i];
+        if (0 != len)
+        {
+            assert(nextCodes[len] < (static_cast<uint64_t>(1) << len));
+            const unsigned int c = static_cast<unsigned int>(nextCodes[len]++);
+            codes.SetCodeLength(i, CodeLength(ReverseBits(c, len), len));
+        }
+    }
+    
+    return codes;
+}
+
+void WriteHuffmanCodeLengths(BitStreamWriter& w, const HuffmanCodeTable& codes)
 {
-    ObjectStorage<Node> storage;
+    const unsigned int countValues = codes.GetCountValues();
+    
+    unsigned int maxLen = 0;
+    for (unsigned int i = 0; i < countValues; ++i)
+    {
+        maxLen = std::max(maxLen, codes.GetCodeLength(i).length);
+    }
+    
+    const unsigned int lenBits = CountBits(maxLen);
+    w.WriteBits(lenBits, 3);
+    
+    for (unsigned int i = 0; i < countValues;)
+    {
+        const unsigned int len = codes.GetCodeLength(i).length;
+        
+        unsigned int run = 1;
+        while ((i + run) < countValues && run < 257 && len == codes.GetCodeLength(i + run).length)
+            ++run;
+        
+        w.WriteBits(len, lenBits);
+        w.WriteBits((run > 1) ? 1 : 0, 1);
+        if (run > 1)
+            w.WriteBits(run - 2, 8);
+        
+        i += run;
+    }
+}
 
-    Node* root = RestoreTree(codes, storage);
+bool ReadHuffmanCodeLengths(BitStreamReader& r, unsigned int countValues, HuffmanCodeTable& codes)
+{
+    const unsigned int lenBits = static_cast<unsigned int>(r.ReadBits(3));
+    
+    std::vector<unsigned int> lengths;
+    lengths.reserve(countValues);
+    
+    // sum of 2^-len scaled by 2^HuffmanMaxCodeLength, canonical codes exist while it is at most 1
+    uint64_t kraft = 0;
     
-    m_storage.swap(storage);
-    m_current = m_root = root;
+    while (lengths.size() < countValues)
+    {
+        const unsigned int len = static_cast<unsigned int>(r.ReadBits(lenBits));
+        const unsigned int run = (0 != r.ReadBits(1)) ? static_cast<unsigned int>(r.ReadBits(8)) + 2 : 1;
+        
+        if (len > HuffmanMaxCodeLength || (lengths.size() + run) > countValues)
+            return false;
+        
+        lengths.insert(lengths.end(), run, len);
+        if (0 != len)
+            kraft += static_cast<uint64_t>(run) << (HuffmanMaxCodeLength - len);
+    }
+    
+    if (kraft > (static_cast<uint64_t>(1) << HuffmanMaxCodeLength) || r.IsOverrun())
+        return false;
+    
+    codes = MakeCanonicalCodesTable(lengths);
+    return true;
 }
 
-struct HuffmanReader::Node
+//
+//
+//
+
+HuffmanDecoder::HuffmanDecoder(const HuffmanCodeTable& codes)
+: m_primaryBits(0)
+, m_maxLength(0)
 {
-    Node(unsigned char v = 0) : left(nullptr), right(nullptr), value(v) {}
+    std::vector<unsigned int> values;
+    unsigned int maxLength = 0;
     
-    Node* left;
-    Node* right;
-    unsigned char value;
-};
+    for (unsigned int i = 0; i < codes.GetCountValues(); ++i)
+    {
+        const CodeLength& codeLength = codes.GetCodeLength(i);
+        if (0 != codeLength.length)
+        {
+            assert(codeLength.length <= HuffmanMaxCodeLength);
+            values.push_back(i);
+            maxLength = std::max(maxLength, codeLength.length);
+        }
+    }
+    
+    m_maxLength = maxLength;
+    m_primaryBits = std::min<unsigned int>(maxLength, HuffmanDecoderTableBits);
+    m_table.resize(static_cast<size_t>(1) << m_primaryBits);
+    
+    BuildTable(codes, 0, m_primaryBits, 0, values);
+}
 
-HuffmanReader::Node* HuffmanReader::RestoreTree(const HuffmanCodeTable& codes, ObjectStorage<Node>& storage)
+// Fills the table of 2^bits entries at offset for codes whose first skip bits are already read
+void HuffmanDecoder::BuildTable(const HuffmanCodeTable& codes, size_t offset, unsigned int bits, unsigned int skip, const std::vector<unsigned int>& values)
 {
-    Node* root = storage.NewObject();
+    std::map<unsigned int, std::vector<unsigned int>> subtables;
     
-    for (unsigned int i = 0; i < ByteTypeCountValues; ++i)
+    for (unsigned int value : values)
     {
-        Node* n = root;
+        const CodeLength& codeLength = codes.GetCodeLength(value);
+        assert(skip < codeLength.length);
         
-        const unsigned char b = static_cast<unsigned char>(i);
-        const CodeLength& codeLength = codes.GetCodeLength(b);
-        for (unsigned int j = 0; j < codeLength.length; ++j)
+        const unsigned int code = codeLength.code >> skip;
+        const unsigned int length = codeLength.length - skip;
+        
+        if (length <= bits)
         {
-            unsigned int bit = (codeLength.code >> j) & 1;
-            if (BitLeft == bit)
-            {
-                if (nullptr == n->left) n->left = storage.NewObject();
-                n = n->left;
-            }
-            else
+            // every index that starts with the code
+            for (size_t i = code & LowBitsMask(length); i < (static_cast<size_t>(1) << bits); i += (static_cast<size_t>(1) << length))
             {
-                if (nullptr == n->right) n->right = storage.NewObject();
-                n = n->right;
+                m_table[offset + i] = Entry(value, length, 0);
             }
         }
-        
-        n->value = i;
+        else
+        {
+            subtables[code & LowBitsMask(bits)].push_back(value);
+        }
     }
     
-    return root;
+    for (auto& s : subtables)
+    {
+        unsigned int maxLength = 0;
+        for (unsigned int value : s.second)
+        {
+            maxLength = std::max(maxLength, codes.GetCodeLength(value).length - skip - bits);
+        }
+        
+        const unsigned int subBits = std::min<unsigned int>(maxLength, HuffmanDecoderTableBits);
+        const size_t subOffset = m_table.size();
+        m_table.resize(subOffset + (static_cast<size_t>(1) << subBits));
+        m_table[offset + s.first] = Entry(static_cast<uint32_t>(subOffset), 0, subBits);
+        
+        BuildTable(codes, subOffset, subBits, skip + bits, s.second);
+    }
 }
 
-HuffmanReader::~HuffmanReader()
+// Bit reader over memory for the interleaved decoding, a local copy stays in registers
+struct MemoryBitReader
 {
-}
+    const unsigned char* next;
+    uint64_t bits;
+    unsigned int count;
+    
+    void Refill()
+    {
+        bits |= LoadLE64(next) << count;
+        next += (63 - count) >> 3;
+        count |= 56;
+    }
+    
+    void Skip(unsigned int countBits)
+    {
+        bits >>= countBits;
+        count -= countBits;
+    }
+};
 
-HuffmanReader::Result HuffmanReader::ReadBit(unsigned int bit, unsigned char* value)
+template <typename Entry>
+static inline unsigned char DecodeValue(const Entry* table, unsigned int primaryBits, MemoryBitReader& r, bool& error)
 {
-    assert(nullptr != value);
-    assert(BitLeft == bit || BitRight == bit);
+    unsigned int bits = primaryBits;
+    const Entry* e = table + (r.bits & LowBitsMask(bits));
+    while (0 == e->length)
+    {
+        if (0 == e->bits)
+        {
+            error = true;
+            return 0;
+        }
+        
+        r.Skip(bits);
+        bits = e->bits;
+        e = table + e->next + (r.bits & LowBitsMask(bits));
+    }
     
-    m_current = (BitLeft == bit) ? m_current->left : m_current->right;
+    r.Skip(e->length);
+    return static_cast<unsigned char>(e->next);
+}
 
-    if (nullptr == m_current)
+// Decodes rounds of a value per sub-stream, ValuesPerRefill rounds come from one refill of 56 bits at least,
+// so ValuesPerRefill codes of the longest length must fit into them. The readers are copied to locals to stay
+// in registers while the output is stored. Returns the count of rounds decoded or -1 on an error.
+template <unsigned int ValuesPerRefill, typename Entry>
+static ptrdiff_t DecodeInterleavedRounds(const Entry* table, unsigned int primaryBits, MemoryBitReader readers[], const unsigned char* const limits[], unsigned char* out, size_t rounds)
+{
+    static_assert(4 == HuffmanInterleavedStreams, "decoding is unrolled for 4 sub-streams");
+    
+    MemoryBitReader r0 = readers[0];
+    MemoryBitReader r1 = readers[1];
+    MemoryBitReader r2 = readers[2];
+    MemoryBitReader r3 = readers[3];
+    
+    const unsigned char* const limit0 = limits[0];
+    const unsigned char* const limit1 = limits[1];
+    const unsigned char* const limit2 = limits[2];
+    const unsigned char* const limit3 = limits[3];
+    
+    bool error = false;
+    
+    const size_t groups = rounds / ValuesPerRefill;
+    for (size_t i = 0; i < groups && !error; ++i)
     {
-        m_current = m_root;
-
-        return HuffmanReader::NoData;
+        if (r0.next > limit0 || r1.next > limit1 || r2.next > limit2 || r3.next > limit3)
+            return -1;
+        
+        r0.Refill();
+        r1.Refill();
+        r2.Refill();
+        r3.Refill();
+        
+        for (unsigned int j = 0; j < ValuesPerRefill; ++j)
+        {
+            out[0] = DecodeValue(table, primaryBits, r0, error);
+            out[1] = DecodeValue(table, primaryBits, r1, error);
+            out[2] = DecodeValue(table, primaryBits, r2, error);
+            out[3] = DecodeValue(table, primaryBits, r3, error);
+            out += HuffmanInterleavedStreams;
+        }
     }
-    else if (nullptr == m_current->left && nullptr == m_current->right)
+    
+    readers[0] = r0;
+    readers[1] = r1;
+    readers[2] = r2;
+    readers[3] = r3;
+    
+    return error ? -1 : static_cast<ptrdiff_t>(groups * ValuesPerRefill);
+}
+
+bool HuffmanDecoder::DecodeInterleaved(const unsigned char* const streams[], const size_t sizes[], unsigned char* out, size_t count) const
+{
+    assert(nullptr != out || 0 == count);
+    
+    MemoryBitReader readers[HuffmanInterleavedStreams];
+    const unsigned char* limits[HuffmanInterleavedStreams];
+    for (unsigned int k = 0; k < HuffmanInterleavedStreams; ++k)
     {
-        *value = m_current->value;
+        readers[k].next = streams[k];
+        readers[k].bits = 0;
+        readers[k].count = 0;
         
-        m_current = m_root;
+        // loaded bytes run up to 8 bytes ahead of the codes, a refill past the limit means the codes
+        // are beyond the end and the refill would read beyond the padding
+        limits[k] = streams[k] + sizes[k] + 8;
+    }
+    
+    size_t rounds = count / HuffmanInterleavedStreams;
+    ptrdiff_t done = 0;
+    
+    if ((4 * m_maxLength) <= BitStreamMaxFastBits)
+        done = DecodeInterleavedRounds<4>(m_table.data(), m_primaryBits, readers, limits, out, rounds);
+    else if ((2 * m_maxLength) <= BitStreamMaxFastBits)
+        done = DecodeInterleavedRounds<2>(m_table.data(), m_primaryBits, readers, limits, out, rounds);
+    
+    if (done < 0)
+        return false;
+    out += done * HuffmanInterleavedStreams;
+    rounds -= done;
+    
+    done = DecodeInterleavedRounds<1>(m_table.data(), m_primaryBits, readers, limits, out, rounds);
+    if (done < 0)
+        return false;
+    out += done * HuffmanInterleavedStreams;
+    
+    bool error = false;
+    for (unsigned int k = 0, tail = count % HuffmanInterleavedStreams; k < tail && !error; ++k)
+    {
+        if (readers[k].next > limits[k])
+            return false;
         
-        return HuffmanReader::Success;
+        readers[k].Refill();
+        *out++ = DecodeValue(m_table.data(), m_primaryBits, readers[k], error);
     }
-    else
+    
+    if (error)
+        return false;
+    
+    // bits taken by the codes must fit into the sub-streams
+    for (unsigned int k = 0; k < HuffmanInterleavedStreams; ++k)
     {
-        return HuffmanReader::ReadMoreBits;
+        const uint64_t read = static_cast<uint64_t>(readers[k].next - streams[k]) * BitsPerByte - readers[k].count;
+        if (read > static_cast<uint64_t>(sizes[k]) * BitsPerByte)
+            return false;
     }
+    
+    return true;
 }
@@ -1,9 +1,9 @@
 #pragma once
 
+#include <cstdint>
 #include <vector>
-#include <unordered_map>
 #include "common.h"
-#include "objstorage.h"
+#include "bitstream.h"
 
 //
 //
@@ -11,29 +11,69 @@
 
 enum { ByteTypeCountValues = 256 };
 
+enum { HuffmanMaxCodeLength = 32 };
+
+// the smallest limit of code lengths that still fits all byte values
+enum { HuffmanMinCodeLengthLimit = 8 };
+
+// alphabets of values other than bytes, such as symbols of lengths, are limited to 2^HuffmanMaxValueBits values
+enum { HuffmanMaxValueBits = 16 };
+
 //
 //
 //
 
+// Codes of all values of an alphabet (byte values by default), a missing value has a zero code length
 class HuffmanCodeTable
 {
 public:
-    HuffmanCodeTable();
-    HuffmanCodeTable(std::unordered_map<unsigned char, CodeLength>&& codes);
-    HuffmanCodeTable(HuffmanCodeTable&& other);
-    HuffmanCodeTable(const HuffmanCodeTable& other);
-    HuffmanCodeTable& operator=(HuffmanCodeTable&& other);
-    HuffmanCodeTable& operator=(const HuffmanCodeTable& other);
+    HuffmanCodeTable(unsigned int countValues = ByteTypeCountValues);
+    
+    void SetCodeLength(unsigned int value, const CodeLength& codeLength);
+    const CodeLength& GetCodeLength(unsigned int value) const;
+    
+    unsigned int GetCountValues() const;
     
-    void SetCodeLength(unsigned char b, const CodeLength& codeLength);
-    const CodeLength& GetCodeLength(unsigned char b) const;
-
     void swap(HuffmanCodeTable& other);
     
 private:
-    std::unordered_map<unsigned char, CodeLength> m_codes;
+    std::vector<CodeLength> m_codes;
 };
 
+inline void HuffmanCodeTable::SetCodeLength(unsigned int value, const CodeLength& codeLength)
+{
+    assert(value < m_codes.size());
+    m_codes[value] = codeLength;
+}
+
+inline const CodeLength& HuffmanCodeTable::GetCodeLength(unsigned int value) const
+{
+    assert(value < m_codes.size());
+    return m_codes[value];
+}
+
+inline unsigned int HuffmanCodeTable::GetCountValues() const
+{
+    return static_cast<unsigned int>(m_codes.size());
+}
+
+//
+// Canonical codes for code lengths of all values of an alphabet (0 for a missing value): shorter codes
+// come first, codes of a length are consecutive in value order. The lengths must satisfy
+// the Kraft inequality. Codes are stored bit-reversed, so BitStreamWriter writes their
+// first bit first and a decoder can be built from the lengths alone.
+//
+
+HuffmanCodeTable MakeCanonicalCodesTable(const std::vector<unsigned int>& lengths);
+
+// Code lengths of a table: 3 bits of the bit count of a length, then runs of equal lengths over all values,
+// each run is a length and a flag, a set flag is followed by 8 bits of the run length minus 2
+void WriteHuffmanCodeLengths(BitStreamWriter& w, const HuffmanCodeTable& codes);
+
+// Reads the code lengths of countValues values into canonical codes,
+// false if they are not a prefix code or the stream ends before
+bool ReadHuffmanCodeLengths(BitStreamReader& r, unsigned int countValues, HuffmanCodeTable& codes);
+
 //
 //
 //
@@ -41,53 +81,118 @@ private:
 class HuffmanScanner
 {
 public:
-    HuffmanScanner();
+    // Codes are limited to maxCodeLength bits (HuffmanMinCodeLengthLimit to HuffmanMaxCodeLength),
+    // an alphabet of more than 2^HuffmanMinCodeLengthLimit values needs a limit that fits its values
+    HuffmanScanner(unsigned int maxCodeLength = HuffmanMaxCodeLength, unsigned int countValues = ByteTypeCountValues);
     
     void BeginScan();
-    void Scan(unsigned char b);
-    void EndScan(HuffmanCodeTable& table, unsigned int& totalLen);
+    void Scan(unsigned int value);
+    
+    // Counts bytes as values of the alphabet, it must hold the byte values
+    void Scan(const unsigned char* data, size_t size);
+    
+    void EndScan(HuffmanCodeTable& table, uint64_t& totalLen);
+    
+    // Ends the scan with the counts of all values only, for coders with their own tables
+    void EndScan(std::vector<uint64_t>& counts);
     
 private:
     HuffmanScanner(const HuffmanScanner&);
     HuffmanScanner& operator=(const HuffmanScanner&);
-
+    
+    // count tables of Scan, merged into m_bytes by EndScan
+    enum { ScanTables = 4 };
+    
     struct Node;
-    struct NodeCodeLength;
     
+    void MergeCounts();
     HuffmanCodeTable BuildCodesTable() const;
-    Node* BuildTree(ObjectStorage<Node>& storage) const;
-    HuffmanCodeTable BuildCodesTableFromTree(Node* root) const;
+    void BuildTree(std::vector<Node>& nodes) const;
+    std::vector<unsigned int> BuildCodeLengthsFromTree(const std::vector<Node>& nodes) const;
+    void LimitCodeLengths(std::vector<unsigned int>& lengths) const;
     
     enum State { state_none, state_scanning };
     
     State m_state;
-    std::vector<unsigned int> m_bytes;
+    std::vector<uint64_t> m_counts;
+    std::vector<uint64_t> m_bytes;  // counts of all values
     unsigned int m_count;
+    const unsigned int m_maxCodeLength;
+    const unsigned int m_countValues;
 };
 
 //
+// Table-driven decoder: a primary table indexed by the next HuffmanDecoderTableBits bits of
+// the stream resolves short codes in one lookup, longer codes continue in subtables.
+// Codes are read LSB first as BitStreamWriter writes them, any prefix code is accepted.
 //
-//
 
-class HuffmanReader
+enum { HuffmanDecoderTableBits = 11 };
+
+// sub-streams of an interleaved code, value i is coded in sub-stream i % HuffmanInterleavedStreams
+enum { HuffmanInterleavedStreams = 4 };
+
+// readable bytes past the end of a sub-stream for the interleaved decoding
+enum { HuffmanInterleavedPadding = 16 };
+
+class HuffmanDecoder
 {
 public:
-    HuffmanReader(const HuffmanCodeTable& codes);
-    ~HuffmanReader();
+    HuffmanDecoder(const HuffmanCodeTable& codes);
     
-    enum Result { Success = 0, ReadMoreBits, NoData };
-
-    Result ReadBit(unsigned int bit, unsigned char* value);
+    // Reads a code from r, returns its length or 0 if the bits are not a code.
+    // T must hold all values of the codes.
+    template <typename T>
+    unsigned int Decode(BitStreamReader& r, T* value) const;
+    
+    // Decodes count byte values of HuffmanInterleavedStreams sub-streams in memory, the sub-streams are followed
+    // by HuffmanInterleavedPadding readable bytes each. Returns false if the bits are not codes or a sub-stream is shorter than its codes.
+    bool DecodeInterleaved(const unsigned char* const streams[], const size_t sizes[], unsigned char* out, size_t count) const;
     
 private:
-    HuffmanReader(const HuffmanReader&);
-    HuffmanReader& operator=(const HuffmanReader&);
+    HuffmanDecoder(const HuffmanDecoder&);
+    HuffmanDecoder& operator=(const HuffmanDecoder&);
     
-    struct Node;
-
-    static Node* RestoreTree(const HuffmanCodeTable& codes, ObjectStorage<Node>& storage);
+    struct Entry
+    {
+        Entry(uint32_t Next = 0, unsigned char Length = 0, unsigned char Bits = 0) : next(Next), length(Length), bits(Bits) {}
+        uint32_t next;        // decoded value of a code, first entry of a subtable for a link
+        unsigned char length; // bits of a code left at this table, 0 for a link or a missing code
+        unsigned char bits;   // index bits of the subtable for a link
+    };
+    
+    void BuildTable(const HuffmanCodeTable& codes, size_t offset, unsigned int bits, unsigned int skip, const std::vector<unsigned int>& values);
     
-    ObjectStorage<Node> m_storage;
-    Node* m_root;
-    Node* m_current;
+    std::vector<Entry> m_table;
+    unsigned int m_primaryBits;
+    unsigned int m_maxLength;
 };
+
+template <typename T>
+inline unsigned int HuffmanDecoder::Decode(BitStreamReader& r, T* value) const
+{
+    assert(nullptr != value);
+    
+    const Entry* table = m_table.data();
+    unsigned int bits = m_primaryBits;
+    unsigned int length = 0;
+    
+    for (;;)
+    {
+        const Entry& e = table[r.PeekBits(bits)];
+        if (0 != e.length)
+        {
+            r.SkipBits(e.length);
+            *value = static_cast<T>(e.next);
+            return length + e.length;
+        }
+        
+        if (0 == e.bits)
+            return 0;
+        
+        r.SkipBits(bits);
+        length += bits;
+        table = m_table.data() + e.next;
+        bits = e.bits;
+    }
+}
@@ -2,77 +2,47 @@
 #include "huffman.h"
 #include "streamimpl.h"
 #include "bitstream.h"
+#include "format.h"
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+
+enum { HuffmanFormatVersion = 5 };
+
+// first version of the canonical codes, version 5 adds interleaved blocks
+enum { HuffmanCodeLengthsFormatVersion = 4 };
+
+// first version of the block framing, with tables of explicit codes
+enum { HuffmanBlocksFormatVersion = 3 };
+
+enum { OutputWindowSize = 1 << 16 };
 
 inline void check_true(bool expr)
 {
     if (!expr) throw std::exception();
 }
 
-static void CompressHuffmanCodesTable(BitStreamWriter& w, const HuffmanCodeTable& codes)
+// Sizes and counts: 6 bits of their bit count minus 1, then the value itself
+static void CompressHuffmanSize(BitStreamWriter& w, uint64_t size)
 {
-    unsigned int cnt = 0;
-    
-    // scan codes to get min and max
-    unsigned char minValue = (unsigned char)-1, maxValue = 0;
-    unsigned int minCode = (unsigned int)-1, maxCode = 0;
-    unsigned int minLen = (unsigned int)-1, maxLen = 0;
-    for (unsigned int i = 0; i < ByteTypeCountValues; ++i)
-    {
-        const unsigned char b = static_cast<unsigned char>(i);
-        const CodeLength& codeLen = codes.GetCodeLength(b);
-        if (codeLen.length != 0)
-        {
-            ++cnt;
-            
-            if (b < minValue) minValue = b;
-            else if (maxValue < b) maxValue = b;
-            
-            if (codeLen.code < minCode) minCode = codeLen.code;
-            else if (maxCode < codeLen.code) maxCode = codeLen.code;
-            
-            if (codeLen.length < minLen) minLen = codeLen.length;
-            else if (maxLen < codeLen.length) maxLen = codeLen.length;
-        }
-    }
-    
-    // bit lengths are
-    unsigned char valueBits = CountBits(maxValue - minValue);
-    unsigned char codeBits = CountBits(maxCode - minCode);
-    unsigned char lenBits = CountBits(maxLen - minLen);
-    
-    // write "header" of codes table
-    check_true( w.WriteBits(cnt) );
-    check_true( w.WriteBits(valueBits) );
-    check_true( w.WriteBits(codeBits) );
-    check_true( w.WriteBits(lenBits) );
-    
-    // write min values
-    check_true( w.WriteBits(minValue) );
-    check_true( w.WriteBits(minCode) );
-    check_true( w.WriteBits(minLen) );
+    unsigned int n = 1;
+    while (0 != (size >> n) && n < 64)
+        ++n;
     
-    // write codes table
-    for (unsigned int i = 0; i < ByteTypeCountValues; ++i)
-    {
-        const unsigned char b = static_cast<unsigned char>(i);
-        const CodeLength& codeLen = codes.GetCodeLength(b);
-        if (codeLen.length != 0)
-        {
-            unsigned char wb = b - minValue;
-            unsigned int wc = codeLen.code - minCode;
-            unsigned int wl = codeLen.length - minLen;
-            check_true( w.WriteBits(&wb, valueBits) );
-            check_true( w.WriteBits(&wc, codeBits) );
-            check_true( w.WriteBits(&wl, lenBits) );
-        }
-    }
+    w.WriteBits(n - 1, 6);
+    w.WriteBits(size, n);
 }
 
-static void DecompressHuffmanCodesTable(BitStreamReader& r, HuffmanCodeTable& codes)
+static uint64_t DecompressHuffmanSize(BitStreamReader& r)
+{
+    const unsigned int n = static_cast<unsigned int>(r.ReadBits(6)) + 1;
+    return r.ReadBits(n);
+}
+
+// Tables of versions 1 to 3: codes count, bit counts and min values of values, codes and lengths,
+// then a value, a code and a length for every code
+static void DecompressHuffmanCodesTable(BitStreamReader& r, unsigned int cnt, HuffmanCodeTable& codes)
 {
-    unsigned int cnt = 0;
-    
     unsigned char valueBits = 0;
     unsigned char codeBits = 0;
     unsigned char lenBits = 0;
@@ -81,8 +51,7 @@ static void DecompressHuffmanCodesTable(BitStreamReader& r, HuffmanCodeTable& co
     unsigned int minCode = 0;
     unsigned int minLen = 0;
     
-    // read "header" of codes table
-    check_true( r.ReadBits(&cnt) );
+    // read "header" of codes table, cnt is read by the caller
     check_true( r.ReadBits(&valueBits) );
     check_true( r.ReadBits(&codeBits) );
     check_true( r.ReadBits(&lenBits) );
@@ -107,69 +76,313 @@ static void DecompressHuffmanCodesTable(BitStreamReader& r, HuffmanCodeTable& co
         check_true( r.ReadBits(&len, lenBits) );
         
         check_true( ((unsigned int)value + minValue) <= 255 );
+        check_true( 0 != (len + minLen) && (len + minLen) <= HuffmanMaxCodeLength );
         
         codes.SetCodeLength(value + minValue, CodeLength(code + minCode, len + minLen));
     }
 }
 
-void Huffman::Compress(IReadStream& source, ISequentialWriteStream& dest)
+// Block header: non-zero "more" byte, code lengths and payload bit count, a zero byte ends the stream
+static void CompressHuffmanBlockHeader(BitStreamWriter& w, const HuffmanCodeTable& codes, uint64_t cntBits)
 {
-    HuffmanCodeTable codes;
-    unsigned int cntBits = 0;
+    const unsigned char more = 1;
+    check_true( w.WriteBits(more) );
+    
+    WriteHuffmanCodeLengths(w, codes);
+    CompressHuffmanSize(w, cntBits);
+}
 
-    check_true( source.Seek(0) );
+static void CompressHuffmanSpan(BitStreamWriter& w, const HuffmanCodeTable& codes, const unsigned char* data, size_t size)
+{
+    unsigned int maxLen = 0;
+    for (unsigned int i = 0; i < ByteTypeCountValues; ++i)
+    {
+        maxLen = std::max(maxLen, codes.GetCodeLength(i).length);
+    }
+    
+    // the writer stores bytes, which may alias the table's storage, the codes are read through a local
+    const CodeLength* const table = &codes.GetCodeLength(0);
+    
+    size_t i = 0;
     
+    // two codes go with a single write while they fit into it
+    if ((2 * maxLen) <= BitStreamMaxFastBits)
     {
-        HuffmanScanner scanner;
-        scanner.BeginScan();
-        for (unsigned char b = 0; sizeof(b) == source.Read(&b, sizeof(b));)
+        for (; (i + 2) <= size; i += 2)
         {
-            scanner.Scan(b);
+            const CodeLength& cl0 = table[data[i]];
+            const CodeLength& cl1 = table[data[i + 1]];
+            w.WriteBits(cl0.code | (static_cast<uint64_t>(cl1.code) << cl0.length), cl0.length + cl1.length);
         }
-        scanner.EndScan(codes, cntBits);
     }
     
-    check_true( source.Seek(0) );
+    for (; i < size; ++i)
+    {
+        const CodeLength& cl = table[data[i]];
+        w.WriteBits(cl.code, cl.length);
+    }
+}
+
+static void DecompressHuffmanPayload(BitStreamReader& r, const HuffmanCodeTable& codes, uint64_t cntBits, ZeroCopyWriter& writer)
+{
+    unsigned char* out = writer.Reserve(OutputWindowSize);
+    size_t outSize = 0;
+    
+    const HuffmanDecoder decoder(codes);
+    
+    uint64_t c = 0;
+    while (c < cntBits)
+    {
+        unsigned char value = 0;
+        const unsigned int len = decoder.Decode(r, &value);
+        check_true( 0 != len );
+        c += len;
+        
+        out[outSize++] = value;
+        if (OutputWindowSize == outSize)
+        {
+            check_true( !r.IsOverrun() );
+            
+            writer.Commit(outSize);
+            out = writer.Reserve(OutputWindowSize);
+            outSize = 0;
+        }
+    }
+    
+    check_true( c == cntBits );
+    check_true( !r.IsOverrun() );
+    
+    writer.Commit(outSize);
+}
+
+// Interleaved block: "more" byte HuffmanInterleavedStreams, code lengths, the count of values and byte sizes
+// of the sub-streams, then the sub-streams from a byte boundary. Value i of the block is coded in sub-stream
+// i % HuffmanInterleavedStreams, so that a decoder follows all of them at once.
+static void CompressHuffmanInterleavedBlock(BitStreamWriter& w, const HuffmanCodeTable& codes, const unsigned char* data, size_t size)
+{
+    std::vector<unsigned char> streams[HuffmanInterleavedStreams];
+    const CodeLength* const table = &codes.GetCodeLength(0);
+    
+    for (unsigned int k = 0; k < HuffmanInterleavedStreams; ++k)
+    {
+        ByteArraySequentialWriteStream stream(&streams[k]);
+        BitStreamWriter sw(&stream);
+        for (size_t i = k; i < size; i += HuffmanInterleavedStreams)
+        {
+            const CodeLength& cl = table[data[i]];
+            sw.WriteBits(cl.code, cl.length);
+        }
+        check_true( sw.CompleteByte() );
+    }
+    
+    const unsigned char more = HuffmanInterleavedStreams;
+    check_true( w.WriteBits(more) );
     
+    WriteHuffmanCodeLengths(w, codes);
+    CompressHuffmanSize(w, size);
+    for (unsigned int k = 0; k < HuffmanInterleavedStreams; ++k)
     {
-        BitStreamWriter w(&dest);
+        CompressHuffmanSize(w, streams[k].size());
+    }
+    check_true( w.CompleteByte() );
+    
+    for (unsigned int k = 0; k < HuffmanInterleavedStreams; ++k)
+    {
+        check_true( w.WriteBytes(streams[k].data(), streams[k].size()) );
+    }
+}
+
+// Reads an interleaved block after its "more" byte
+static void DecompressHuffmanInterleavedBlock(BitStreamReader& r, ZeroCopyWriter& writer)
+{
+    HuffmanCodeTable codes;
+    check_true( ReadHuffmanCodeLengths(r, ByteTypeCountValues, codes) );
+    
+    const uint64_t count = DecompressHuffmanSize(r);
+    
+    uint64_t sizes[HuffmanInterleavedStreams];
+    for (unsigned int k = 0; k < HuffmanInterleavedStreams; ++k)
+    {
+        sizes[k] = DecompressHuffmanSize(r);
+        check_true( sizes[k] <= (count / HuffmanInterleavedStreams + 1) * (HuffmanMaxCodeLength / BitsPerByte) );
+    }
+    
+    r.AlignToByte();
+    
+    // the decoder reads past the end of a sub-stream
+    std::vector<unsigned char> streams[HuffmanInterleavedStreams];
+    const unsigned char* data[HuffmanInterleavedStreams];
+    size_t dataSizes[HuffmanInterleavedStreams];
+    uint64_t totalSize = 0;
+    for (unsigned int k = 0; k < HuffmanInterleavedStreams; ++k)
+    {
+        dataSizes[k] = static_cast<size_t>(sizes[k]);
+        streams[k].resize(dataSizes[k] + HuffmanInterleavedPadding);
+        check_true( r.ReadBytes(streams[k].data(), dataSizes[k]) );
+        data[k] = streams[k].data();
+        totalSize += sizes[k];
+    }
+    
+    // every code takes a bit at least
+    check_true( count <= totalSize * BitsPerByte );
+    
+    const HuffmanDecoder decoder(codes);
+    
+    unsigned char* out = writer.Reserve(static_cast<size_t>(count));
+    check_true( decoder.DecodeInterleaved(data, dataSizes, out, static_cast<size_t>(count)) );
+    writer.Commit(static_cast<size_t>(count));
+}
+
+//
+//
+//
+
+Huffman::Huffman(const CompressorOptions& options, bool interleaved)
+: m_blockSize(options.blockSize)
+, m_maxCodeLength((0 != options.maxCodeLength) ? options.maxCodeLength : HuffmanMaxCodeLength)
+, m_interleaved(interleaved)
+{
+}
+
+void Huffman::Compress(IReadStream& source, ISequentialWriteStream& dest)
+{
+    check_true( HuffmanMinCodeLengthLimit <= m_maxCodeLength && m_maxCodeLength <= HuffmanMaxCodeLength );
+    
+    // sources that can not be rewound are compressed in blocks, as well as interleaved streams
+    const bool seekable = source.Seek(0) && !m_interleaved;
+    
+    WriteFormatHeader(dest, HuffmanFormatVersion);
+    
+    BitStreamWriter w(&dest);
+    HuffmanScanner scanner(m_maxCodeLength);
+    HuffmanCodeTable codes;
+    uint64_t cntBits = 0;
+    
+    if (0 == m_blockSize && seekable)
+    {
+        uint64_t size = 0;
         
-        CompressHuffmanCodesTable(w, codes);
+        scanner.BeginScan();
+        ForEachSpan(source, [&](const unsigned char* data, size_t n)
+        {
+            scanner.Scan(data, n);
+            size += n;
+        });
+        scanner.EndScan(codes, cntBits);
         
-        check_true( w.WriteBits(&cntBits, BitsPerByte * sizeof(cntBits)) );
+        check_true( source.Seek(0) );
         
-        for (unsigned char b = 0; sizeof(b) == source.Read(&b, sizeof(b));)
+        if (0 != size)
         {
-            const CodeLength& cl = codes.GetCodeLength(b);
-            check_true( w.WriteBits(&cl.code, cl.length) );
+            CompressHuffmanBlockHeader(w, codes, cntBits);
+            ForEachSpan(source, [&](const unsigned char* data, size_t n)
+            {
+                CompressHuffmanSpan(w, codes, data, n);
+            });
+            check_true( w.CompleteByte() );
         }
-        
-        check_true( w.CompleteByte() );
     }
+    else
+    {
+        ForEachBlock(source, (0 != m_blockSize) ? m_blockSize : DefaultBlockSize, [&](const unsigned char* data, size_t n)
+        {
+            scanner.BeginScan();
+            scanner.Scan(data, n);
+            scanner.EndScan(codes, cntBits);
+            
+            if (m_interleaved)
+            {
+                CompressHuffmanInterleavedBlock(w, codes, data, n);
+            }
+            else
+            {
+                CompressHuffmanBlockHeader(w, codes, cntBits);
+                CompressHuffmanSpan(w, codes, data, n);
+            }
+            check_true( w.CompleteByte() );
+        });
+    }
+    
+    const unsigned char more = 0;
+    check_true( w.WriteBits(more) );
+    check_true( w.CompleteByte() );
 }
 
 void Huffman::Decompress(ISequentialReadStream& source, ISequentialWriteStream& dest)
 {
-    BitStreamReader r(&source);
-    
-    HuffmanCodeTable codes;
-    DecompressHuffmanCodesTable(r, codes);
+    unsigned char version = 0;
+    uint32_t head = 0;
+    check_true( ReadFormatHeader(source, &version, &head) );
+    check_true( LegacyFormatVersion <= version && version <= HuffmanFormatVersion );
     
-    unsigned int cntBits = 0;
-    check_true( r.ReadBits(&cntBits, BitsPerByte * sizeof(cntBits)) );
+    BitStreamReader r(&source);
+    ZeroCopyWriter writer(&dest);
     
-    HuffmanReader reader(codes);
-    HuffmanReader::Result res = HuffmanReader::Success;
-    for (unsigned int i = 0; i < cntBits; ++i)
+    if (HuffmanBlocksFormatVersion <= version)
     {
-        unsigned int bit = 0;
-        check_true( r.ReadBits(&bit, 1) );
-        unsigned char value = 0;
-        if (HuffmanReader::Success == (res = reader.ReadBit(bit, &value)))
+        for (;;)
         {
-            check_true( dest.Write(&value, sizeof(value)) == sizeof(value) );
+            unsigned char more = 0;
+            check_true( r.ReadBits(&more) );
+            if (0 == more)
+                break;
+            
+            if (HuffmanInterleavedStreams == more && HuffmanFormatVersion == version)
+            {
+                DecompressHuffmanInterleavedBlock(r, writer);
+                continue;
+            }
+            check_true( 1 == more );
+            
+            HuffmanCodeTable codes;
+            uint64_t cntBits = 0;
+            
+            if (HuffmanBlocksFormatVersion == version)
+            {
+                unsigned int cnt = 0;
+                check_true( r.ReadBits(&cnt) );
+                DecompressHuffmanCodesTable(r, cnt, codes);
+                check_true( r.ReadBits(&cntBits) );
+            }
+            else
+            {
+                assert(HuffmanCodeLengthsFormatVersion <= version);
+                check_true( ReadHuffmanCodeLengths(r, ByteTypeCountValues, codes) );
+                cntBits = DecompressHuffmanSize(r);
+            }
+            
+            DecompressHuffmanPayload(r, codes, cntBits, writer);
+            
+            r.AlignToByte();
+        }
+    }
+    else
+    {
+        // versions 1 and 2 hold a single block without the "more" byte,
+        // legacy streams start with the codes count and store a 32-bit payload length
+        unsigned int cnt = head;
+        if (LegacyFormatVersion != version)
+        {
+            check_true( r.ReadBits(&cnt) );
         }
+        
+        HuffmanCodeTable codes;
+        DecompressHuffmanCodesTable(r, cnt, codes);
+        
+        uint64_t cntBits = 0;
+        if (LegacyFormatVersion == version)
+        {
+            uint32_t legacyCntBits = 0;
+            check_true( r.ReadBits(&legacyCntBits) );
+            cntBits = legacyCntBits;
+        }
+        else
+        {
+            check_true( r.ReadBits(&cntBits) );
+        }
+        
+        DecompressHuffmanPayload(r, codes, cntBits, writer);
     }
     
-    check_true( HuffmanReader::Success == res );
+    writer.Flush();
 }
@@ -5,6 +5,15 @@
 class Huffman : public ICompressor
 {
 public:
+    // Interleaved blocks code values into several sub-streams that are decoded together,
+    // they are faster to decode but always compressed in blocks.
+    Huffman(const CompressorOptions& options = CompressorOptions(), bool interleaved = false);
+    
     virtual void Compress(IReadStream& source, ISequentialWriteStream& dest);
     virtual void Decompress(ISequentialReadStream& source, ISequentialWriteStream& dest);
+    
+private:
+    const size_t m_blockSize;
+    const unsigned int m_maxCodeLength;
+    const bool m_interleaved;
 };
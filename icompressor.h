@@ -2,6 +2,37 @@
 
 #include "istream.h"
 
+//
+//
+//
+
+enum { DefaultBlockSize = 1 << 22 };
+
+struct CompressorOptions
+{
+    CompressorOptions() : blockSize(0), maxCodeLength(0), contextOrder(0), dictionaryBits(0), level(0) {}
+    
+    // Input block size for block-streaming codecs, 0 compresses a seekable source as a single block.
+    // Sources that can not be rewound are always compressed in blocks (DefaultBlockSize if 0).
+    size_t blockSize;
+    
+    // Limit of Huffman code lengths in bits, 0 for the codec's own limit
+    unsigned int maxCodeLength;
+    
+    // Count of previous bytes that adaptive models of a byte depend on
+    unsigned int contextOrder;
+    
+    // Size of LZW dictionaries in bits of a code, 0 for the codec's default
+    unsigned int dictionaryBits;
+    
+    // Effort of match finders, 0 for the codec's default
+    unsigned int level;
+};
+
+//
+//
+//
+
 class ICompressor
 {
 public:
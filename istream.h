@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+
 //
 //
 //
@@ -7,7 +10,7 @@
 class ISequentialReadStream
 {
 public:
-    virtual unsigned int Read(void* data, unsigned int size) = 0;
+    virtual size_t Read(void* data, size_t size) = 0;
     virtual ~ISequentialReadStream() {}
 };
 
@@ -18,8 +21,8 @@ public:
 class IReadStream : public ISequentialReadStream
 {
 public:
-    virtual unsigned int GetPos() = 0;
-    virtual bool Seek(unsigned int pos) = 0;
+    virtual uint64_t GetPos() = 0;
+    virtual bool Seek(uint64_t pos) = 0;
 };
 
 //
@@ -29,6 +32,35 @@ public:
 class ISequentialWriteStream
 {
 public:
-    virtual unsigned int Write(const void* data, unsigned int size) = 0;
+    virtual size_t Write(const void* data, size_t size) = 0;
     virtual ~ISequentialWriteStream() {}
 };
+
+//
+// Zero-copy access to the bytes of streams that own a buffer or a mapping
+//
+
+class IZeroCopyReadStream
+{
+public:
+    // Returns a window of *size readable bytes at the current position, *size is 0 at the end
+    // of the stream. The window stays valid until the next call on the stream.
+    virtual const unsigned char* Peek(size_t* size) = 0;
+    // Advances the current position by size bytes of the last window
+    virtual void Consume(size_t size) = 0;
+    virtual ~IZeroCopyReadStream() {}
+};
+
+//
+//
+//
+
+class IZeroCopyWriteStream
+{
+public:
+    // Returns a window of size writable bytes, it stays valid until the next call on the stream
+    virtual unsigned char* Reserve(size_t size) = 0;
+    // Appends the first size bytes of the last reserved window to the stream
+    virtual void Commit(size_t size) = 0;
+    virtual ~IZeroCopyWriteStream() {}
+};
@@ -0,0 +1,286 @@
+#include "lz.h"
+
+#include <cassert>
+#include <algorithm>
+
+//
+//
+//
+
+// nibbles of a token, 15 is continued by bytes
+enum { LzTokenMask = 15 };
+
+enum { LzFastSkipShift = 6, LzNoSkipShift = 63 };
+
+inline uint32_t HashLz(uint32_t prefix)
+{
+    return (prefix * 2654435761u) >> (32 - LzHashBits);
+}
+
+// length of the common prefix of a and b, up to limit
+static inline size_t MatchLength(const unsigned char* a, const unsigned char* b, size_t limit)
+{
+    size_t i = 0;
+    while (i + 8 <= limit)
+    {
+        const uint64_t diff = LoadLE64(a + i) ^ LoadLE64(b + i);
+        if (0 != diff)
+            return i + (__builtin_ctzll(diff) >> 3);
+        i += 8;
+    }
+    
+    while (i < limit && a[i] == b[i])
+        ++i;
+    return i;
+}
+
+//
+//
+//
+
+LzMatchFinder::LzMatchFinder(unsigned int level)
+: m_head(static_cast<size_t>(1) << LzHashBits)
+, m_chain(LzWindowSize)
+, m_depth((LzFastLevel == level) ? 1 : (LzGreedyLevel == level) ? 16 : 64)
+, m_lazy(level >= LzLazyLevel)
+, m_skipShift((LzFastLevel == level) ? LzFastSkipShift : LzNoSkipShift)
+, m_insertMatches(LzFastLevel != level)
+{
+    assert(LzFastLevel <= level && level <= LzLazyLevel);
+}
+
+inline void LzMatchFinder::Insert(const unsigned char* data, size_t pos)
+{
+    const uint32_t h = HashLz(LoadLE32(data + pos));
+    m_chain[pos & LzMaxOffset] = m_head[h];
+    m_head[h] = static_cast<int32_t>(pos);
+}
+
+unsigned int LzMatchFinder::FindMatch(const unsigned char* data, size_t pos, size_t size, uint32_t* offset)
+{
+    assert(pos + LzMinMatch <= size);
+    
+    const uint32_t prefix = LoadLE32(data + pos);
+    const uint32_t h = HashLz(prefix);
+    
+    int32_t candidate = m_head[h];
+    m_chain[pos & LzMaxOffset] = candidate;
+    m_head[h] = static_cast<int32_t>(pos);
+    
+    const size_t limit = size - pos;
+    size_t best = LzMinMatch - 1;
+    
+    // positions of a chain decrease, the chain ends at the first one out of the window
+    for (unsigned int depth = m_depth; 0 != depth && candidate >= 0 && (pos - candidate) <= LzMaxOffset; --depth)
+    {
+        const unsigned char* match = data + candidate;
+        
+        // a longer match has the byte after the best one too
+        if (match[best] == data[pos + best] && LoadLE32(match) == prefix)
+        {
+            const size_t length = MatchLength(match + LzMinMatch, data + pos + LzMinMatch, limit - LzMinMatch) + LzMinMatch;
+            if (length > best)
+            {
+                best = length;
+                *offset = static_cast<uint32_t>(pos - candidate);
+                if (best == limit)
+                    break;
+            }
+        }
+        
+        candidate = m_chain[candidate & LzMaxOffset];
+    }
+    
+    return static_cast<unsigned int>(best);
+}
+
+void LzMatchFinder::Parse(const unsigned char* data, size_t size, std::vector<LzSequence>& sequences)
+{
+    assert(nullptr != data || 0 == size);
+    assert(size <= INT32_MAX);
+    
+    sequences.clear();
+    
+    // chains are followed from the heads only, so they need no reset
+    std::fill(m_head.begin(), m_head.end(), -1);
+    
+    // positions with a whole prefix
+    const size_t end = (size >= LzMinMatch) ? size - LzMinMatch + 1 : 0;
+    
+    size_t anchor = 0;  // first literal of the current sequence
+    size_t pos = 0;
+    uint64_t misses = 0;
+    
+    while (pos < end)
+    {
+        uint32_t offset = 0;
+        unsigned int length = FindMatch(data, pos, size, &offset);
+        if (length < LzMinMatch)
+        {
+            // positions skipped are not inserted
+            pos += 1 + (misses++ >> m_skipShift);
+            continue;
+        }
+        
+        // a longer match at the next position makes the current byte a literal
+        size_t inserted = pos + 1;  // positions below are in the chains
+        while (m_lazy && inserted == (pos + 1) && inserted < end)
+        {
+            uint32_t nextOffset = 0;
+            const unsigned int nextLength = FindMatch(data, inserted++, size, &nextOffset);
+            if (nextLength > length)
+            {
+                ++pos;
+                length = nextLength;
+                offset = nextOffset;
+            }
+        }
+        
+        LzSequence s;
+        s.literals = static_cast<uint32_t>(pos - anchor);
+        s.length = length;
+        s.offset = offset;
+        sequences.push_back(s);
+        
+        misses = 0;
+        anchor = pos + length;
+        // the fast level only inserts the end of a match, where the next one may start
+        pos = m_insertMatches ? inserted : std::max(inserted, anchor - 2);
+        for (; pos < anchor && pos < end; ++pos)
+        {
+            Insert(data, pos);
+        }
+        pos = anchor;
+    }
+    
+    LzSequence last;
+    last.literals = static_cast<uint32_t>(size - anchor);
+    last.length = 0;
+    last.offset = 0;
+    sequences.push_back(last);
+}
+
+//
+//
+//
+
+// the part of a count above the 15 of its nibble, 255 continues it
+static inline unsigned char* WriteLzLength(unsigned char* out, size_t rest)
+{
+    for (; rest >= 255; rest -= 255)
+    {
+        *out++ = 255;
+    }
+    *out++ = static_cast<unsigned char>(rest);
+    return out;
+}
+
+void EncodeLzBlock(const unsigned char* data, const std::vector<LzSequence>& sequences, std::vector<unsigned char>& out)
+{
+    assert(!sequences.empty() && 0 == sequences.back().length);
+    
+    // a match takes fewer bytes than it covers, literals take a byte more for 255 of them at most
+    size_t size = 0;
+    for (size_t i = 0; i < sequences.size(); ++i)
+    {
+        size += sequences[i].literals + sequences[i].length;
+    }
+    
+    const size_t start = out.size();
+    out.resize(start + size + size / 255 + 16);
+    unsigned char* op = out.data() + start;
+    
+    for (size_t i = 0; i < sequences.size(); ++i)
+    {
+        const LzSequence& s = sequences[i];
+        assert(0 == s.length || (LzMinMatch <= s.length && 0 < s.offset && s.offset <= LzMaxOffset));
+        
+        const size_t literals = s.literals;
+        const size_t length = (0 != s.length) ? s.length - LzMinMatch : 0;
+        
+        const size_t token = (std::min<size_t>(literals, LzTokenMask) << 4) | std::min<size_t>(length, LzTokenMask);
+        *op++ = static_cast<unsigned char>(token);
+        
+        if (literals >= LzTokenMask)
+            op = WriteLzLength(op, literals - LzTokenMask);
+        
+        memcpy(op, data, literals);
+        op += literals;
+        data += literals + s.length;
+        
+        if (0 == s.length)
+            break;
+        
+        *op++ = static_cast<unsigned char>(s.offset);
+        *op++ = static_cast<unsigned char>(s.offset >> 8);
+        
+        if (length >= LzTokenMask)
+            op = WriteLzLength(op, length - LzTokenMask);
+    }
+    
+    out.resize(op - out.data());
+}
+
+// Adds the bytes of a count continued past its nibble, false if the block ends within them
+static inline bool ReadLzLength(const unsigned char*& in, const unsigned char* end, size_t* count)
+{
+    unsigned char b = 255;
+    while (255 == b)
+    {
+        if (in == end)
+            return false;
+        b = *in++;
+        *count += b;
+    }
+    return true;
+}
+
+bool DecodeLzBlock(const unsigned char* block, size_t blockSize, unsigned char* out, size_t size)
+{
+    assert(nullptr != block || 0 == blockSize);
+    assert(nullptr != out);
+    
+    const unsigned char* in = block;
+    const unsigned char* const inEnd = block + blockSize;
+    unsigned char* op = out;
+    unsigned char* const outEnd = out + size;
+    
+    for (;;)
+    {
+        if (in == inEnd)
+            return false;
+        
+        const unsigned int token = *in++;
+        
+        size_t literals = token >> 4;
+        if (LzTokenMask == literals && !ReadLzLength(in, inEnd, &literals))
+            return false;
+        if (literals > static_cast<size_t>(inEnd - in) || literals > static_cast<size_t>(outEnd - op))
+            return false;
+        
+        CopyLzWords<16>(op, in, literals);
+        op += literals;
+        in += literals;
+        
+        if (in == inEnd)
+            break;
+        
+        if ((inEnd - in) < 2)
+            return false;
+        const size_t offset = in[0] | (static_cast<size_t>(in[1]) << 8);
+        in += 2;
+        
+        size_t length = token & LzTokenMask;
+        if (LzTokenMask == length && !ReadLzLength(in, inEnd, &length))
+            return false;
+        length += LzMinMatch;
+        
+        if (0 == offset || offset > static_cast<size_t>(op - out) || length > static_cast<size_t>(outEnd - op))
+            return false;
+        
+        CopyLzMatch(op, offset, length);
+        op += length;
+    }
+    
+    return op == outEnd;
+}
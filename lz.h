@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "common.h"
+
+//
+// LZ77 parsing: data is split into sequences of literal bytes followed by a match, a copy of length bytes
+// from offset bytes back in the data. Matches are found in a sliding window through hash chains of the
+// positions of 4-byte prefixes.
+//
+
+enum { LzMinMatch = 4, LzWindowBits = 16, LzWindowSize = 1 << LzWindowBits, LzMaxOffset = LzWindowSize - 1 };
+
+enum { LzHashBits = 16 };
+
+// Levels of LzMatchFinder: LzFastLevel takes the latest position of a prefix and skips ahead faster
+// through data without matches, LzGreedyLevel takes the longest match of a hash chain and
+// LzLazyLevel also tries the next position before it takes a match.
+enum { LzFastLevel = 1, LzGreedyLevel = 2, LzLazyLevel = 3, LzDefaultLevel = LzGreedyLevel };
+
+struct LzSequence
+{
+    uint32_t literals;  // count of literal bytes before the match
+    uint32_t length;    // length of the match, 0 for the last sequence of a block
+    uint32_t offset;    // distance from the match to its copy
+};
+
+//
+//
+//
+
+class LzMatchFinder
+{
+public:
+    LzMatchFinder(unsigned int level = LzDefaultLevel);
+    
+    // Sequences of data, the last one holds the literals up to the end of data and no match.
+    // Matches do not reach before data, blocks are parsed independently.
+    void Parse(const unsigned char* data, size_t size, std::vector<LzSequence>& sequences);
+    
+private:
+    LzMatchFinder(const LzMatchFinder&);
+    LzMatchFinder& operator=(const LzMatchFinder&);
+    
+    void Insert(const unsigned char* data, size_t pos);
+    
+    // Inserts pos and returns the length of the longest match found for it, less than LzMinMatch if none
+    unsigned int FindMatch(const unsigned char* data, size_t pos, size_t size, uint32_t* offset);
+    
+    std::vector<int32_t> m_head;   // latest position of a hash, -1 if none
+    std::vector<int32_t> m_chain;  // previous position of the hash of a position in the window
+    unsigned int m_depth;          // count of chain positions tried
+    bool m_lazy;
+    unsigned int m_skipShift;      // the step through data without matches grows by 1 every 2^m_skipShift positions
+    bool m_insertMatches;          // positions within matches go into the chains
+};
+
+//
+// Blocks: a sequence is a token byte with the count of literals in its high 4 bits and the length of
+// the match minus LzMinMatch in its low 4 bits, 15 is continued by bytes that are added up to a byte
+// other than 255. The literals follow the count, the 2-byte offset (little endian) follows them and
+// the rest of the length comes last. The last sequence ends after its literals.
+//
+
+// readable bytes past a block and writable bytes past its data for the decoding, copies run in words
+enum { LzPadding = 32 };
+
+// Appends the block of sequences of data to out
+void EncodeLzBlock(const unsigned char* data, const std::vector<LzSequence>& sequences, std::vector<unsigned char>& out);
+
+// Decodes a block followed by LzPadding readable bytes into size bytes of out followed by LzPadding
+// writable bytes. Returns false if the block does not decode to exactly size bytes.
+bool DecodeLzBlock(const unsigned char* block, size_t blockSize, unsigned char* out, size_t size);
+
+// Copies size bytes by words of Size bytes, up to Size - 1 bytes more are read and written,
+// out may follow in by Size bytes at least. Most copies are short, the first word is copied
+// before the loop so they take no loop branch.
+template <size_t Size>
+inline void CopyLzWords(unsigned char* out, const unsigned char* in, size_t size)
+{
+    memcpy(out, in, Size);
+    for (size_t i = Size; i < size; i += Size)
+    {
+        memcpy(out + i, in + i, Size);
+    }
+}
+
+// Copies a match of length bytes from offset bytes back to out, up to LzPadding bytes more are written
+inline void CopyLzMatch(unsigned char* out, size_t offset, size_t length)
+{
+    static_assert(LzPadding >= 16, "copies run in words of 16 bytes");
+    assert(0 != offset);
+    
+    const unsigned char* match = out - offset;
+    if (offset >= 16)
+    {
+        CopyLzWords<16>(out, match, length);
+    }
+    else if (offset >= 8)
+    {
+        CopyLzWords<8>(out, match, length);
+    }
+    else
+    {
+        // the match repeats its first offset bytes, after a few bytes a repetition 8 bytes back at least
+        // is copied by words
+        const size_t step = offset * ((8 + offset - 1) / offset);
+        size_t i = 0;
+        for (; i < length && i < (step - offset); ++i)
+        {
+            out[i] = match[i];
+        }
+        if (i < length)
+            CopyLzWords<8>(out + i, out + i - step, length - i);
+    }
+}
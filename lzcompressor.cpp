@@ -0,0 +1,145 @@
+#include "lzcompressor.h"
+#include "lz.h"
+#include "streamimpl.h"
+#include "bitstream.h"
+#include "format.h"
+#include <algorithm>
+#include <cassert>
+
+enum { LzFormatVersion = 2 };
+
+// blocks are decoded in one piece, larger ones are split
+enum { LzMaxBlockSize = 1 << 26 };
+
+// "more" bytes of the blocks
+enum { LzCodedBlock = 1, LzStoredBlock = 2 };
+
+inline void check_true(bool expr)
+{
+    if (!expr) throw std::exception();
+}
+
+// Coded block: "more" byte LzCodedBlock, 32 bits of the size of the data and of the block, then the block.
+// Stored block: "more" byte LzStoredBlock and 32 bits of the size, then the data. Data that does not
+// get smaller is stored.
+static void CompressLzBlock(BitStreamWriter& w, LzMatchFinder& finder, std::vector<LzSequence>& sequences,
+    std::vector<unsigned char>& block, const unsigned char* data, size_t size)
+{
+    finder.Parse(data, size, sequences);
+    
+    block.clear();
+    EncodeLzBlock(data, sequences, block);
+    
+    const uint32_t size32 = static_cast<uint32_t>(size);
+    if (block.size() < size)
+    {
+        const unsigned char more = LzCodedBlock;
+        const uint32_t blockSize32 = static_cast<uint32_t>(block.size());
+        check_true( w.WriteBits(more) );
+        check_true( w.WriteBits(size32) );
+        check_true( w.WriteBits(blockSize32) );
+        check_true( w.WriteBytes(block.data(), block.size()) );
+    }
+    else
+    {
+        const unsigned char more = LzStoredBlock;
+        check_true( w.WriteBits(more) );
+        check_true( w.WriteBits(size32) );
+        check_true( w.WriteBytes(data, size) );
+    }
+}
+
+// Reads a coded block after its "more" byte, block holds the block and LzPadding bytes
+static void DecompressLzBlock(BitStreamReader& r, ZeroCopyWriter& writer, std::vector<unsigned char>& block)
+{
+    uint32_t size = 0;
+    uint32_t blockSize = 0;
+    check_true( r.ReadBits(&size) );
+    check_true( r.ReadBits(&blockSize) );
+    check_true( size <= LzMaxBlockSize && blockSize < size );
+    
+    block.resize(blockSize + LzPadding);
+    check_true( r.ReadBytes(block.data(), blockSize) );
+    
+    unsigned char* out = writer.Reserve(size + LzPadding);
+    check_true( DecodeLzBlock(block.data(), blockSize, out, size) );
+    writer.Commit(size);
+}
+
+// Reads a stored block after its "more" byte
+static void DecompressLzStoredBlock(BitStreamReader& r, ZeroCopyWriter& writer)
+{
+    uint32_t size = 0;
+    check_true( r.ReadBits(&size) );
+    check_true( size <= LzMaxBlockSize );
+    
+    unsigned char* out = writer.Reserve(size);
+    check_true( r.ReadBytes(out, size) );
+    writer.Commit(size);
+}
+
+//
+//
+//
+
+Lz::Lz(const CompressorOptions& options)
+: m_blockSize(options.blockSize)
+, m_level((0 != options.level) ? options.level : LzDefaultLevel)
+{
+}
+
+// Stream: blocks until a "more" byte 0, all fields are whole bytes
+void Lz::Compress(IReadStream& source, ISequentialWriteStream& dest)
+{
+    check_true( LzFastLevel <= m_level && m_level <= LzLazyLevel );
+    
+    const size_t blockSize = (0 != m_blockSize) ? std::min(m_blockSize, static_cast<size_t>(LzMaxBlockSize)) : DefaultBlockSize;
+    
+    WriteFormatHeader(dest, LzFormatVersion);
+    
+    BitStreamWriter w(&dest);
+    LzMatchFinder finder(m_level);
+    std::vector<LzSequence> sequences;
+    std::vector<unsigned char> block;
+    
+    ForEachBlock(source, blockSize, [&](const unsigned char* data, size_t n)
+    {
+        CompressLzBlock(w, finder, sequences, block, data, n);
+    });
+    
+    const unsigned char more = 0;
+    check_true( w.WriteBits(more) );
+    check_true( w.CompleteByte() );
+}
+
+void Lz::Decompress(ISequentialReadStream& source, ISequentialWriteStream& dest)
+{
+    unsigned char version = 0;
+    uint32_t head = 0;
+    check_true( ReadFormatHeader(source, &version, &head) );
+    check_true( LzFormatVersion == version );
+    
+    BitStreamReader r(&source);
+    ZeroCopyWriter writer(&dest);
+    std::vector<unsigned char> block;
+    
+    for (;;)
+    {
+        unsigned char more = 0;
+        check_true( r.ReadBits(&more) );
+        if (0 == more)
+            break;
+        
+        if (LzCodedBlock == more)
+        {
+            DecompressLzBlock(r, writer, block);
+        }
+        else
+        {
+            check_true( LzStoredBlock == more );
+            DecompressLzStoredBlock(r, writer);
+        }
+    }
+    
+    writer.Flush();
+}
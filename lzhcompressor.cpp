@@ -0,0 +1,291 @@
+#include "lzhcompressor.h"
+#include "lz.h"
+#include "huffman.h"
+#include "streamimpl.h"
+#include "bitstream.h"
+#include "format.h"
+#include <algorithm>
+#include <cassert>
+
+enum { LzhFormatVersion = 2 };
+
+// blocks are decoded in one piece, larger ones are split
+enum { LzhMaxBlockSize = 1 << 26 };
+
+// "more" bytes of the blocks
+enum { LzhCodedBlock = 1, LzhStoredBlock = 2 };
+
+// Lengths and distances are coded by slots: a value below LzhDirectSlots is its own slot, a larger value with
+// the highest bit n is slot 2n plus the bit below n, the n - 1 bits below that follow the code of the slot
+enum { LzhDirectSlots = 4 };
+
+// Symbols of literals and lengths: the byte values, the end of a block, then the slots of lengths minus LzMinMatch
+enum { LzhEndSymbol = ByteTypeCountValues, LzhFirstLengthSymbol = LzhEndSymbol + 1, LzhLengthSlots = 54 };
+enum { LzhLiteralSymbols = LzhFirstLengthSymbol + LzhLengthSlots };
+
+// Symbols of distances: the slots of distances minus 1
+enum { LzhDistanceSymbols = 2 * LzWindowBits };
+
+// codes of both alphabets mostly take a single lookup of the decoder
+enum { LzhMaxCodeLength = 15 };
+
+static_assert(LzhMaxBlockSize <= (1 << (LzhLengthSlots / 2)), "a slot for every length of a block");
+
+inline void check_true(bool expr)
+{
+    if (!expr) throw std::exception();
+}
+
+inline unsigned int GetLzhSlot(uint32_t value)
+{
+    if (value < LzhDirectSlots)
+        return value;
+    
+    const unsigned int n = CountBits(value) - 1;
+    return 2 * n + ((value >> (n - 1)) & 1);
+}
+
+// count of the bits that follow the code of a slot
+inline unsigned int GetLzhSlotBits(unsigned int slot)
+{
+    return (slot < LzhDirectSlots) ? 0 : slot / 2 - 1;
+}
+
+inline uint32_t GetLzhSlotBase(unsigned int slot)
+{
+    return (slot < LzhDirectSlots) ? slot : (2u | (slot & 1)) << (slot / 2 - 1);
+}
+
+// the code of the slot of value and its bits in a single write
+static inline void WriteLzhValue(BitStreamWriter& w, const CodeLength* codes, unsigned int firstSymbol, uint32_t value)
+{
+    const unsigned int slot = GetLzhSlot(value);
+    const CodeLength& cl = codes[firstSymbol + slot];
+    w.WriteBits(cl.code | (static_cast<uint64_t>(value - GetLzhSlotBase(slot)) << cl.length), cl.length + GetLzhSlotBits(slot));
+}
+
+static inline uint32_t ReadLzhValue(BitStreamReader& r, unsigned int slot)
+{
+    return GetLzhSlotBase(slot) + static_cast<uint32_t>(r.ReadBits(GetLzhSlotBits(slot)));
+}
+
+// Counts the symbols of the sequences of data and builds the codes of both alphabets
+static void ScanLzhSequences(HuffmanScanner& literals, HuffmanScanner& distances, const std::vector<LzSequence>& sequences,
+    const unsigned char* data, HuffmanCodeTable& literalCodes, HuffmanCodeTable& distanceCodes)
+{
+    literals.BeginScan();
+    distances.BeginScan();
+    
+    for (const LzSequence& s : sequences)
+    {
+        literals.Scan(data, s.literals);
+        data += s.literals + s.length;
+        
+        if (0 != s.length)
+        {
+            literals.Scan(LzhFirstLengthSymbol + GetLzhSlot(s.length - LzMinMatch));
+            distances.Scan(GetLzhSlot(s.offset - 1));
+        }
+    }
+    literals.Scan(LzhEndSymbol);
+    
+    uint64_t totalLen = 0;
+    literals.EndScan(literalCodes, totalLen);
+    distances.EndScan(distanceCodes, totalLen);
+}
+
+// Coded block: "more" byte LzhCodedBlock, 32 bits of the size of the data, code lengths of literals and lengths
+// and of distances, then the codes of the sequences up to LzhEndSymbol. A literal is the code of its byte value,
+// a match is the code of the slot of its length, the bits of the length, the code of the slot of its distance
+// and the bits of the distance. Stored block: "more" byte LzhStoredBlock, 32 bits of the size, then the data.
+// Data that does not get smaller is stored.
+static void CompressLzhBlock(BitStreamWriter& w, LzMatchFinder& finder, HuffmanScanner& literals, HuffmanScanner& distances,
+    std::vector<LzSequence>& sequences, std::vector<unsigned char>& block, const unsigned char* data, size_t size)
+{
+    finder.Parse(data, size, sequences);
+    
+    HuffmanCodeTable literalCodes(LzhLiteralSymbols);
+    HuffmanCodeTable distanceCodes(LzhDistanceSymbols);
+    ScanLzhSequences(literals, distances, sequences, data, literalCodes, distanceCodes);
+    
+    block.clear();
+    {
+        ByteArraySequentialWriteStream stream(&block);
+        BitStreamWriter bw(&stream);
+        
+        WriteHuffmanCodeLengths(bw, literalCodes);
+        WriteHuffmanCodeLengths(bw, distanceCodes);
+        
+        const CodeLength* const literalTable = &literalCodes.GetCodeLength(0);
+        const CodeLength* const distanceTable = &distanceCodes.GetCodeLength(0);
+        
+        const unsigned char* p = data;
+        for (const LzSequence& s : sequences)
+        {
+            for (size_t i = 0; i < s.literals; ++i)
+            {
+                const CodeLength& cl = literalTable[p[i]];
+                bw.WriteBits(cl.code, cl.length);
+            }
+            p += s.literals + s.length;
+            
+            if (0 != s.length)
+            {
+                WriteLzhValue(bw, literalTable, LzhFirstLengthSymbol, s.length - LzMinMatch);
+                WriteLzhValue(bw, distanceTable, 0, s.offset - 1);
+            }
+        }
+        
+        const CodeLength& end = literalTable[LzhEndSymbol];
+        bw.WriteBits(end.code, end.length);
+        check_true( bw.CompleteByte() );
+    }
+    
+    const uint32_t size32 = static_cast<uint32_t>(size);
+    if (block.size() < size)
+    {
+        const unsigned char more = LzhCodedBlock;
+        check_true( w.WriteBits(more) );
+        check_true( w.WriteBits(size32) );
+        check_true( w.WriteBytes(block.data(), block.size()) );
+    }
+    else
+    {
+        const unsigned char more = LzhStoredBlock;
+        check_true( w.WriteBits(more) );
+        check_true( w.WriteBits(size32) );
+        check_true( w.WriteBytes(data, size) );
+    }
+}
+
+// Reads a coded block after its "more" byte
+static void DecompressLzhBlock(BitStreamReader& r, ZeroCopyWriter& writer)
+{
+    uint32_t size = 0;
+    check_true( r.ReadBits(&size) );
+    check_true( size <= LzhMaxBlockSize );
+    
+    HuffmanCodeTable literalCodes(LzhLiteralSymbols);
+    HuffmanCodeTable distanceCodes(LzhDistanceSymbols);
+    check_true( ReadHuffmanCodeLengths(r, LzhLiteralSymbols, literalCodes) );
+    check_true( ReadHuffmanCodeLengths(r, LzhDistanceSymbols, distanceCodes) );
+    
+    const HuffmanDecoder literals(literalCodes);
+    const HuffmanDecoder distances(distanceCodes);
+    
+    // matches are copied by words past their end
+    unsigned char* const out = writer.Reserve(size + LzPadding);
+    unsigned char* const end = out + size;
+    unsigned char* op = out;
+    
+    for (;;)
+    {
+        unsigned int symbol = 0;
+        check_true( 0 != literals.Decode(r, &symbol) );
+        
+        if (symbol < LzhEndSymbol)
+        {
+            check_true( op != end );
+            *op++ = static_cast<unsigned char>(symbol);
+            continue;
+        }
+        
+        if (LzhEndSymbol == symbol)
+            break;
+        
+        const size_t length = ReadLzhValue(r, symbol - LzhFirstLengthSymbol) + LzMinMatch;
+        
+        unsigned int slot = 0;
+        check_true( 0 != distances.Decode(r, &slot) );
+        const size_t offset = ReadLzhValue(r, slot) + 1;
+        
+        check_true( offset <= static_cast<size_t>(op - out) && length <= static_cast<size_t>(end - op) );
+        CopyLzMatch(op, offset, length);
+        op += length;
+    }
+    
+    check_true( op == end );
+    check_true( !r.IsOverrun() );
+    r.AlignToByte();
+    
+    writer.Commit(size);
+}
+
+// Reads a stored block after its "more" byte
+static void DecompressLzhStoredBlock(BitStreamReader& r, ZeroCopyWriter& writer)
+{
+    uint32_t size = 0;
+    check_true( r.ReadBits(&size) );
+    check_true( size <= LzhMaxBlockSize );
+    
+    unsigned char* out = writer.Reserve(size);
+    check_true( r.ReadBytes(out, size) );
+    writer.Commit(size);
+}
+
+//
+//
+//
+
+Lzh::Lzh(const CompressorOptions& options)
+: m_blockSize(options.blockSize)
+, m_level((0 != options.level) ? options.level : LzLazyLevel)
+{
+}
+
+// Stream: blocks until a "more" byte 0, a block starts at a byte boundary
+void Lzh::Compress(IReadStream& source, ISequentialWriteStream& dest)
+{
+    check_true( LzFastLevel <= m_level && m_level <= LzLazyLevel );
+    
+    const size_t blockSize = (0 != m_blockSize) ? std::min(m_blockSize, static_cast<size_t>(LzhMaxBlockSize)) : DefaultBlockSize;
+    
+    WriteFormatHeader(dest, LzhFormatVersion);
+    
+    BitStreamWriter w(&dest);
+    LzMatchFinder finder(m_level);
+    HuffmanScanner literals(LzhMaxCodeLength, LzhLiteralSymbols);
+    HuffmanScanner distances(LzhMaxCodeLength, LzhDistanceSymbols);
+    std::vector<LzSequence> sequences;
+    std::vector<unsigned char> block;
+    
+    ForEachBlock(source, blockSize, [&](const unsigned char* data, size_t n)
+    {
+        CompressLzhBlock(w, finder, literals, distances, sequences, block, data, n);
+    });
+    
+    const unsigned char more = 0;
+    check_true( w.WriteBits(more) );
+    check_true( w.CompleteByte() );
+}
+
+void Lzh::Decompress(ISequentialReadStream& source, ISequentialWriteStream& dest)
+{
+    unsigned char version = 0;
+    uint32_t head = 0;
+    check_true( ReadFormatHeader(source, &version, &head) );
+    check_true( LzhFormatVersion == version );
+    
+    BitStreamReader r(&source);
+    ZeroCopyWriter writer(&dest);
+    
+    for (;;)
+    {
+        unsigned char more = 0;
+        check_true( r.ReadBits(&more) );
+        if (0 == more)
+            break;
+        
+        if (LzhCodedBlock == more)
+        {
+            DecompressLzhBlock(r, writer);
+        }
+        else
+        {
+            check_true( LzhStoredBlock == more );
+            DecompressLzhStoredBlock(r, writer);
+        }
+    }
+    
+    writer.Flush();
+}
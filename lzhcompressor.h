@@ -0,0 +1,17 @@
+#pragma once
+
+#include "icompressor.h"
+
+class Lzh : public ICompressor
+{
+public:
+    // A block is parsed in memory, so a source is always compressed in blocks
+    Lzh(const CompressorOptions& options = CompressorOptions());
+    
+    virtual void Compress(IReadStream& source, ISequentialWriteStream& dest);
+    virtual void Decompress(ISequentialReadStream& source, ISequentialWriteStream& dest);
+    
+private:
+    const size_t m_blockSize;
+    const unsigned int m_level;
+};
@@ -1,124 +1,203 @@
 #include "lzw.h"
 #include <cassert>
+#include <limits>
 
 //
 //
 //
 
-size_t ByteVectorHash::operator()(const std::vector<unsigned char>& key) const {
-    std::hash<unsigned char> sh;
-    size_t h = 0;
-    for (size_t i = 0, n = key.size(); i < n; ++i)
-    {
-        h = h * 31 + sh(key[i]);
-    }
-    return h;
-};
+// initial size of the phrase table, it is kept at most half full
+enum { LzwInitialTableBits = 16 };
 
-//
-//
-//
+static unsigned int GetLzwMaxCodes(unsigned int maxCodes)
+{
+    return (0 != maxCodes) ? maxCodes : std::numeric_limits<unsigned int>::max();
+}
 
-LzwCompressor::LzwCompressor()
+LzwCompressor::LzwCompressor(unsigned int firstCode, unsigned int maxCodes)
 : m_state(state_none)
-{}
+, m_firstCode(firstCode)
+, m_maxCodes(GetLzwMaxCodes(maxCodes))
+, m_tableBits(0)
+, m_nextCode(0)
+, m_current(0)
+, m_empty(true)
+{
+    assert(256 <= firstCode && firstCode < m_maxCodes);
+}
+
+inline uint64_t LzwCompressor::MakeKey(unsigned int prefix, unsigned char b)
+{
+    return (static_cast<uint64_t>(prefix) << 8) | b;
+}
+
+// Fibonacci hashing, the high bits of the product depend on all bits of the key
+inline size_t HashLzwKey(uint64_t key, unsigned int bits)
+{
+    return static_cast<size_t>((key * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+}
 
 void LzwCompressor::Begin(std::function<void(unsigned int)> out)
 {
     assert(state_none == m_state);
     
-    for (unsigned int i = 0; i <= 255; ++i)
-    {
-        Sequence s = { static_cast<unsigned char>(i) };
-        m_codes[s] = i;
-    }
-    
     m_state = state_compressing;
     
     m_out = out;
+    
+    Reset();
 }
 
 void LzwCompressor::Put(unsigned char b)
 {
     assert(state_compressing == m_state);
     
-    m_current.push_back(b);
+    if (m_empty)
+    {
+        m_current = b;
+        m_empty = false;
+        return;
+    }
     
-    auto itr = m_codes.find(m_current);
-    if (itr == m_codes.end())
+    const uint64_t key = MakeKey(m_current, b);
+    const size_t mask = m_table.size() - 1;
+    
+    size_t i = HashLzwKey(key, m_tableBits);
+    for (; 0 != m_table[i].code; i = (i + 1) & mask)
     {
-        unsigned int c = static_cast<unsigned int>(m_codes.size());
-        m_codes.insert(make_pair(m_current, c));
-        
-        m_current.pop_back();
-        
-        itr = m_codes.find(m_current);
-        assert(m_codes.end() != itr);
-        
-        m_out(itr->second);
-        
-        m_current.clear();
-        m_current.push_back(b);
+        if (key == m_table[i].key)
+        {
+            m_current = m_table[i].code;
+            return;
+        }
+    }
+    
+    // the phrase extended by b is new, it gets the next code while there is one and b starts the next phrase
+    m_out(m_current);
+    m_current = b;
+    
+    if (IsFull())
+        return;
+    
+    m_table[i].key = key;
+    m_table[i].code = m_nextCode++;
+    
+    if (2 * static_cast<size_t>(m_nextCode - m_firstCode) > m_table.size())
+        Grow();
+}
+
+void LzwCompressor::Reset()
+{
+    assert(state_compressing == m_state);
+    
+    if (!m_empty)
+    {
+        m_out(m_current);
     }
+    
+    m_tableBits = LzwInitialTableBits;
+    m_table.assign(static_cast<size_t>(1) << m_tableBits, Entry());
+    m_nextCode = m_firstCode;
+    m_empty = true;
+}
+
+bool LzwCompressor::IsFull() const
+{
+    return m_nextCode >= m_maxCodes;
 }
 
 void LzwCompressor::End()
 {
     assert(state_compressing == m_state);
     
-    if (!m_current.empty())
+    if (!m_empty)
     {
-        auto itr = m_codes.find(m_current);
-        assert(m_codes.end() != itr);
-        
-        m_out(itr->second);
+        m_out(m_current);
     }
     
-    m_codes.clear();
-    m_current.clear();
+    m_table.clear();
+    m_empty = true;
     
     m_state = state_none;
 }
 
+void LzwCompressor::Grow()
+{
+    std::vector<Entry> table(m_table.size() * 2, Entry());
+    ++m_tableBits;
+    
+    const size_t mask = table.size() - 1;
+    for (const Entry& e : m_table)
+    {
+        if (0 == e.code)
+            continue;
+        
+        size_t i = HashLzwKey(e.key, m_tableBits);
+        while (0 != table[i].code)
+            i = (i + 1) & mask;
+        table[i] = e;
+    }
+    
+    m_table.swap(table);
+}
+
 //
 //
 //
 
-LzwDecompressor::LzwDecompressor()
+// size of the output buffer, a longer phrase grows it
+enum { LzwOutputBufferSize = 1 << 16 };
+
+LzwDecompressor::LzwDecompressor(unsigned int firstCode, unsigned int maxCodes)
 : m_state(state_none)
-{}
+, m_firstCode(firstCode)
+, m_maxCodes(GetLzwMaxCodes(maxCodes))
+, m_prev(0)
+, m_empty(true)
+, m_size(0)
+{
+    assert(256 <= firstCode && firstCode < m_maxCodes);
+}
 
-void LzwDecompressor::Begin(std::function<void(const std::vector<unsigned char>&)> out)
+void LzwDecompressor::Begin(std::function<void(const unsigned char*, size_t)> out)
 {
     assert(state_none == m_state);
     
-    m_state = state_decompressing;
+    m_buffer.resize(LzwOutputBufferSize);
+    m_size = 0;
     
-    m_codes.init();
+    m_state = state_decompressing;
     
     m_out = out;
+    
+    Reset();
 }
 
 bool LzwDecompressor::Put(unsigned int code)
 {
     assert(state_decompressing == m_state);
     
-    const Sequence* const s = m_codes.findSequence(code);
-    if (s == nullptr)
+    if (code < m_codes.size())
     {
-        if (m_prev.empty() || code > m_codes.size())
+        if (0 == m_codes[code].length)
             return false;
-        m_prev.push_back(m_prev[0]);
-        m_out(m_prev);
-        m_codes.insert(m_prev);
+        
+        // the previous phrase extended by the first byte of this one is the next code
+        if (!m_empty)
+            Add(m_prev, m_codes[code].first);
     }
     else
     {
-        m_out(*s);
-        m_prev.push_back(s->operator[](0));
-        m_codes.insert(m_prev);
-        m_prev = *s;
+        // the code being defined: the previous phrase extended by its own first byte
+        if (m_empty || code != m_codes.size() || code >= m_maxCodes)
+            return false;
+        Add(m_prev, m_codes[m_prev].first);
     }
+    
+    Write(code);
+    
+    m_prev = code;
+    m_empty = false;
     return true;
 }
 
@@ -126,60 +205,71 @@ void LzwDecompressor::End()
 {
     assert(state_decompressing == m_state);
     
+    Flush();
+    
     m_codes.clear();
-    m_prev.clear();
+    m_empty = true;
     
     m_state = state_none;
 }
 
-//
-
-const unsigned int* LzwDecompressor::Codes::findCode(const Sequence& s) const
+void LzwDecompressor::Reset()
 {
-    auto itr = m_codes.find(s);
-    if (m_codes.end() != itr) return &itr->second;
-    else return nullptr;
+    assert(state_decompressing == m_state);
+    
+    m_codes.resize(m_firstCode);
+    for (unsigned int i = 0; i < m_firstCode; ++i)
+    {
+        Entry& e = m_codes[i];
+        e.prefix = 0;
+        e.length = (i <= 255) ? 1 : 0;
+        e.last = e.first = static_cast<unsigned char>(i);
+    }
+    
+    m_empty = true;
 }
 
-const LzwDecompressor::Sequence* LzwDecompressor::Codes::findSequence(unsigned int c) const
+void LzwDecompressor::Add(unsigned int prefix, unsigned char last)
 {
-    auto i = m_sequences.find(c);
-    if (i != m_sequences.end()) return &i->second;
-    else return nullptr;
+    // a full dictionary is not extended, as by LzwCompressor
+    if (m_codes.size() >= m_maxCodes)
+        return;
+    
+    const Entry& p = m_codes[prefix];
+    
+    Entry e;
+    e.prefix = prefix;
+    e.length = p.length + 1;
+    e.last = last;
+    e.first = p.first;
+    m_codes.push_back(e);
 }
 
-bool LzwDecompressor::Codes::insert(const Sequence& s)
+void LzwDecompressor::Write(unsigned int code)
 {
-    auto itr = m_codes.find(s);
-    const bool res = (m_codes.end() == itr);
-    if (res)
+    const size_t length = m_codes[code].length;
+    if ((m_size + length) > m_buffer.size())
     {
-        unsigned int c = static_cast<unsigned int>(m_codes.size());
-        m_codes[s] = c;
-        m_sequences[c] = s;
+        Flush();
+        if (length > m_buffer.size())
+            m_buffer.resize(length);
     }
-    return res;
-}
-
-void LzwDecompressor::Codes::init()
-{
-    m_codes.clear();
-    m_sequences.clear();
-    for (unsigned int i = 0; i <= 255; ++i)
+    
+    // the last byte of a phrase comes first
+    unsigned char* p = m_buffer.data() + m_size + length;
+    for (size_t i = 0; i < length; ++i)
     {
-        Sequence s = { static_cast<unsigned char>(i) };
-        m_sequences[i] = s;
-        m_codes[s] = i;
+        const Entry& e = m_codes[code];
+        *--p = e.last;
+        code = e.prefix;
     }
+    
+    m_size += length;
 }
 
-void LzwDecompressor::Codes::clear()
-{
-    m_codes.clear();
-    m_sequences.clear();
-}
-
-size_t LzwDecompressor::Codes::size() const
+void LzwDecompressor::Flush()
 {
-    return m_codes.size();
+    if (0 != m_size)
+        m_out(m_buffer.data(), m_size);
+    m_size = 0;
 }
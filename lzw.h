@@ -1,69 +1,94 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <vector>
 #include <functional>
-#include <unordered_map>
 
-struct ByteVectorHash
-{
-    size_t operator()(const std::vector<unsigned char>& key) const;
-};
+//
+// Phrases are coded as the code of their prefix and their last byte, codes 0 to 255 are the single bytes
+// and codes from firstCode on are given in the order phrases are added, those in between are left to
+// the caller. The dictionary holds codes up to maxCodes - 1, 0 means no limit.
+//
 
 class LzwCompressor
 {
 public:
-    LzwCompressor();
+    LzwCompressor(unsigned int firstCode = 256, unsigned int maxCodes = 0);
     
     void Begin(std::function<void(unsigned int)> out);
     void Put(unsigned char b);
     void End();
     
+    // Ends the current phrase and empties the dictionary
+    void Reset();
+    bool IsFull() const;
+    
 private:
-    typedef std::vector<unsigned char> Sequence;
-    typedef std::unordered_map<Sequence, unsigned int, ByteVectorHash> Sequence2Code;
+    // open addressing table of phrases, an empty entry has code 0
+    struct Entry
+    {
+        uint64_t key;      // prefix code and last byte, see MakeKey
+        unsigned int code;
+    };
+    
+    static uint64_t MakeKey(unsigned int prefix, unsigned char b);
+    void Grow();
     
     enum State { state_none, state_compressing } m_state;
     
-    Sequence2Code m_codes;
-    Sequence m_current;
+    const unsigned int m_firstCode;
+    const unsigned int m_maxCodes;
+    
+    std::vector<Entry> m_table;
+    unsigned int m_tableBits;
+    unsigned int m_nextCode;
+    
+    unsigned int m_current;  // code of the phrase read so far
+    bool m_empty;            // no phrase is read yet
     
     std::function<void(unsigned int)> m_out;
 };
 
+// Phrases are rebuilt into an output buffer that is passed to out in spans,
+// every phrase is reached from its code by walking its prefixes back
 class LzwDecompressor
 {
 public:
-    LzwDecompressor();
-
-    void Begin(std::function<void(const std::vector<unsigned char>&)> out);
+    // Codes as of LzwCompressor with the same firstCode and maxCodes
+    LzwDecompressor(unsigned int firstCode = 256, unsigned int maxCodes = 0);
+    
+    void Begin(std::function<void(const unsigned char*, size_t)> out);
     bool Put(unsigned int code);
     void End();
     
-private:
-    typedef std::vector<unsigned char> Sequence;
+    // Empties the dictionary, counterpart of LzwCompressor::Reset
+    void Reset();
     
-    class Codes
+private:
+    struct Entry
     {
-    public:
-        const unsigned int* findCode(const Sequence& s) const;
-        const Sequence* findSequence(unsigned int c) const;
-        bool insert(const Sequence& s);
-        void init();
-        void clear();
-        size_t size() const;
-        
-    private:
-        typedef std::unordered_map<unsigned int, Sequence> Code2Sequence;
-        typedef std::unordered_map<Sequence, unsigned int, ByteVectorHash> Sequence2Code;
-        
-        Sequence2Code m_codes;
-        Code2Sequence m_sequences;
+        unsigned int prefix;  // code of the phrase without its last byte
+        unsigned int length;  // 0 for the codes left to the caller
+        unsigned char last;
+        unsigned char first;
     };
     
+    void Add(unsigned int prefix, unsigned char last);
+    void Write(unsigned int code);
+    void Flush();
+    
     enum State { state_none, state_decompressing } m_state;
     
-    Codes m_codes;
-    Sequence m_prev;
+    const unsigned int m_firstCode;
+    const unsigned int m_maxCodes;
+    
+    std::vector<Entry> m_codes;
+    unsigned int m_prev;  // code of the previous phrase
+    bool m_empty;         // no phrase is decoded yet
+    
+    std::vector<unsigned char> m_buffer;
+    size_t m_size;
     
-    std::function<void(const std::vector<unsigned char>&)> m_out;
+    std::function<void(const unsigned char*, size_t)> m_out;
 };
@@ -2,12 +2,32 @@
 #include "lzw.h"
 #include "common.h"
 #include "bitstream.h"
+#include "format.h"
+#include "streamimpl.h"
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 
 //
 //
 //
 
+enum { LzwFormatVersion = 2, BitLzwFormatVersion = 3 };
+
+// first version of BitLzw with a header, codes of a fixed width follow the count of codes
+enum { BitLzwFixedWidthFormatVersion = 2 };
+
+// codes of the bounded dictionary of BitLzw, phrases start at BitLzwFirstCode
+enum { BitLzwClearCode = 256, BitLzwEndCode = 257, BitLzwFirstCode = 258 };
+
+enum { BitLzwMinDictionaryBits = 12, BitLzwMaxDictionaryBits = 20, BitLzwDefaultDictionaryBits = 16 };
+
+// input bytes between checks of the compression ratio once the dictionary is full
+enum { BitLzwCheckGap = 10000 };
+
+// codes of a fixed width unpacked at once
+enum { BitLzwUnpackBatchSize = 256 };
+
 inline void check_true(bool expr)
 {
     if (!expr) throw std::exception();
@@ -22,12 +42,21 @@ void for_each(ISequentialReadStream& source, F f)
     }
 }
 
-template <typename T, typename F>
-void for_each(IReadStream& source, F f)
+template <typename F>
+void for_each_byte(ISequentialReadStream& source, F f)
+{
+    ForEachSpan(source, [&](const unsigned char* data, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i) f(data[i]);
+    });
+}
+
+template <typename F>
+void for_each_byte(IReadStream& source, F f)
 {
     check_true( source.Seek(0) );
     ISequentialReadStream& sequentialSource = source;
-    for_each<T>(sequentialSource, f);
+    for_each_byte(sequentialSource, f);
 }
 
 //
@@ -36,8 +65,9 @@ void for_each(IReadStream& source, F f)
 
 void Lzw::Compress(IReadStream& source, ISequentialWriteStream& dest)
 {
-    check_true( source.Seek(0) );
-
+    // single pass, sources that can not be rewound (pipes) are read from where they are
+    source.Seek(0);
+    
     ISequentialReadStream& sequentialSource = source;
     
     Compress(sequentialSource, dest);
@@ -50,22 +80,34 @@ void Lzw::Compress(ISequentialReadStream& source, ISequentialWriteStream& dest)
         check_true( dest.Write(&c, sizeof(c)) == sizeof(c) );
     };
     
+    WriteFormatHeader(dest, LzwFormatVersion);
+    
     LzwCompressor compressor;
     compressor.Begin(l);
-    for_each<unsigned char>(source, [&](unsigned char b){ compressor.Put(b); });
+    for_each_byte(source, [&](unsigned char b){ compressor.Put(b); });
     compressor.End();
 }
 
 void Lzw::Decompress(ISequentialReadStream& source, ISequentialWriteStream& dest)
 {
-    auto l = [&](const std::vector<unsigned char>& data)
+    auto l = [&](const unsigned char* data, size_t size)
     {
-        unsigned int n = static_cast<unsigned int>(data.size());
-        check_true( n == dest.Write(&data[0], n) );
+        check_true( size == dest.Write(data, size) );
     };
     
+    unsigned char version = 0;
+    uint32_t head = 0;
+    if (!ReadFormatHeader(source, &version, &head))
+        return; // empty legacy stream
+    check_true( LegacyFormatVersion == version || LzwFormatVersion == version );
+    
     LzwDecompressor decompressor;
     decompressor.Begin(l);
+    if (LegacyFormatVersion == version)
+    {
+        // legacy streams have no header, head is the first code
+        check_true( decompressor.Put(head) );
+    }
     for_each<unsigned int>(source, [&](unsigned int v){ check_true( decompressor.Put(v) ); });
     decompressor.End();
 }
@@ -74,73 +116,206 @@ void Lzw::Decompress(ISequentialReadStream& source, ISequentialWriteStream& dest
 //
 //
 
-void BitLzw::Compress(IReadStream& source, ISequentialWriteStream& dest)
+BitLzw::BitLzw(const CompressorOptions& options)
+: m_dictionaryBits((0 != options.dictionaryBits) ? options.dictionaryBits : BitLzwDefaultDictionaryBits)
 {
-    unsigned int min = 0, max = 0, count = 0;
+}
+
+// Width of the next code: codes up to limit may come, limit is one more for each code since the dictionary
+// was emptied, as the dictionary grows by a phrase with each code, up to the largest code of the dictionary
+class BitLzwCodeWidth
+{
+public:
+    BitLzwCodeWidth(unsigned int dictionaryBits) : m_maxLimit((1u << dictionaryBits) - 1) { Reset(); }
     
-    auto lscan = [&](unsigned int c)
+    unsigned int Next()
     {
-        if (0 == count) { min = max = c; }
-        else if (min > c) min = c;
-        else if (max < c) max = c;
-        ++count;
-    };
+        const unsigned int width = m_width;
+        if (m_limit < m_maxLimit)
+        {
+            ++m_limit;
+            m_width = CountBits(m_limit);
+        }
+        return width;
+    }
     
-    LzwCompressor compressor;
+    void Reset()
+    {
+        m_limit = BitLzwFirstCode - 1;
+        m_width = CountBits(m_limit);
+    }
     
-    compressor.Begin(lscan);
-    for_each<unsigned char>(source, [&](unsigned char b){ compressor.Put(b); });
-    compressor.End();
+private:
+    const unsigned int m_maxLimit;
+    unsigned int m_limit;
+    unsigned int m_width;
+};
+
+// Stream: a byte of the dictionary bits, then codes from the LSB of widths of BitLzwCodeWidth up to BitLzwEndCode.
+// BitLzwClearCode empties the dictionary when the compression ratio falls (as of compress(1)), a full dictionary
+// is not extended before.
+void BitLzw::Compress(IReadStream& source, ISequentialWriteStream& dest)
+{
+    check_true( BitLzwMinDictionaryBits <= m_dictionaryBits && m_dictionaryBits <= BitLzwMaxDictionaryBits );
+    
+    // single pass, sources that can not be rewound (pipes) are read from where they are
+    source.Seek(0);
     
-    unsigned char len = CountBits(max - min);
+    WriteFormatHeader(dest, BitLzwFormatVersion);
     
     BitStreamWriter w(&dest);
-    check_true( w.WriteBits(count) );
-    check_true( w.WriteBits(min) );
-    check_true( w.WriteBits(len) );
+    const unsigned char dictionaryBits = static_cast<unsigned char>(m_dictionaryBits);
+    check_true( w.WriteBits(dictionaryBits) );
     
-    auto lwrite = [&](unsigned int c)
+    BitLzwCodeWidth width(m_dictionaryBits);
+    uint64_t outBits = 0;
+    
+    auto l = [&](unsigned int c)
     {
-        c -= min;
-        check_true( w.WriteBits(&c, len) );
+        const unsigned int n = width.Next();
+        w.WriteBits(c, n);
+        outBits += n;
     };
     
-    compressor.Begin(lwrite);
-    for_each<unsigned char>(source, [&](unsigned char b){ compressor.Put(b); });
+    LzwCompressor compressor(BitLzwFirstCode, 1u << m_dictionaryBits);
+    compressor.Begin(l);
+    
+    uint64_t inBytes = 0;
+    uint64_t checkpoint = BitLzwCheckGap;
+    uint64_t ratio = 0;  // input bytes per output byte, 8 bits of fraction
+    
+    ForEachSpan(source, [&](const unsigned char* data, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            compressor.Put(data[i]);
+            
+            if (++inBytes < checkpoint || !compressor.IsFull())
+                continue;
+            
+            checkpoint = inBytes + BitLzwCheckGap;
+            
+            const uint64_t current = (inBytes << 8) / std::max<uint64_t>(outBits / BitsPerByte, 1);
+            if (current > ratio)
+            {
+                ratio = current;
+                continue;
+            }
+            
+            ratio = 0;
+            compressor.Reset();
+            l(BitLzwClearCode);
+            width.Reset();
+        }
+    });
+    
     compressor.End();
+    l(BitLzwEndCode);
     
     check_true( w.CompleteByte() );
 }
 
-void BitLzw::Decompress(ISequentialReadStream& source, ISequentialWriteStream& dest)
+static void DecompressBitLzwCodes(BitStreamReader& r, ISequentialWriteStream& dest)
 {
-    BitStreamReader r(&source);
+    unsigned char dictionaryBits = 0;
+    check_true( r.ReadBits(&dictionaryBits) );
+    check_true( BitLzwMinDictionaryBits <= dictionaryBits && dictionaryBits <= BitLzwMaxDictionaryBits );
+    
+    ZeroCopyWriter writer(&dest);
+    auto l = [&](const unsigned char* data, size_t size)
+    {
+        unsigned char* out = writer.Reserve(size);
+        memcpy(out, data, size);
+        writer.Commit(size);
+    };
+    
+    LzwDecompressor decompressor(BitLzwFirstCode, 1u << dictionaryBits);
+    decompressor.Begin(l);
+    
+    BitLzwCodeWidth width(dictionaryBits);
+    for (;;)
+    {
+        const unsigned int code = static_cast<unsigned int>(r.ReadBits(width.Next()));
+        check_true( !r.IsOverrun() );
+        
+        if (BitLzwEndCode == code)
+            break;
+        
+        if (BitLzwClearCode == code)
+        {
+            decompressor.Reset();
+            width.Reset();
+            continue;
+        }
+        
+        check_true( decompressor.Put(code) );
+    }
+    
+    decompressor.End();
+    writer.Flush();
+}
 
+// Versions 1 and 2: the count of codes, the min code and the width of codes less the min code
+static void DecompressBitLzwFixedWidthCodes(BitStreamReader& r, unsigned char version, uint32_t head, ISequentialWriteStream& dest)
+{
     unsigned char len = 0;
-    unsigned int min = 0, count = 0;
+    unsigned int min = 0;
+    uint64_t count = head; // legacy streams start with a 32-bit count
     
-    check_true( r.ReadBits(&count) );
+    if (LegacyFormatVersion != version)
+    {
+        check_true( r.ReadBits(&count) );
+    }
     check_true( r.ReadBits(&min) );
     check_true( r.ReadBits(&len) );
+    // the width of a code is CountBits of the largest one less min, 1 bit at least
+    check_true( 0 < len && len <= BitStreamMaxFieldBits );
     
-    auto l = [&](const std::vector<unsigned char>& data)
+    auto l = [&](const unsigned char* data, size_t size)
     {
-        unsigned int n = static_cast<unsigned int>(data.size());
-        check_true( n == dest.Write(&data[0], n) );
+        check_true( size == dest.Write(data, size) );
     };
     
     LzwDecompressor decompressor;
     
     decompressor.Begin(l);
     
-    for (unsigned int c = 0; c < count; ++c)
+    // codes are unpacked in batches by the kernel of their width
+    const UnpackBitsFunction unpack = GetUnpackBits(len);
+    uint32_t codes[BitLzwUnpackBatchSize];
+    
+    while (0 != count)
     {
-        unsigned int code = 0;
-        check_true( r.ReadBits(&code, len) );
-        code += min;
+        const size_t n = static_cast<size_t>(std::min<uint64_t>(count, BitLzwUnpackBatchSize));
+        count -= n;
         
-        check_true( decompressor.Put(code) );
+        unpack(r, codes, n);
+        check_true( !r.IsOverrun() );
+        
+        for (size_t i = 0; i < n; ++i)
+        {
+            check_true( decompressor.Put(codes[i] + min) );
+        }
     }
-
+    
     decompressor.End();
 }
+
+void BitLzw::Decompress(ISequentialReadStream& source, ISequentialWriteStream& dest)
+{
+    unsigned char version = 0;
+    uint32_t head = 0;
+    check_true( ReadFormatHeader(source, &version, &head) );
+    check_true( LegacyFormatVersion == version || BitLzwFixedWidthFormatVersion == version || BitLzwFormatVersion == version );
+    
+    BitStreamReader r(&source);
+    
+    if (BitLzwFormatVersion == version)
+    {
+        DecompressBitLzwCodes(r, dest);
+    }
+    else
+    {
+        DecompressBitLzwFixedWidthCodes(r, version, head, dest);
+    }
+}
@@ -14,6 +14,13 @@ public:
 class BitLzw : public ICompressor
 {
 public:
+    // Codes are taken from a dictionary of 2^dictionaryBits codes of the options,
+    // their width grows with the dictionary
+    BitLzw(const CompressorOptions& options = CompressorOptions());
+    
     virtual void Compress(IReadStream& source, ISequentialWriteStream& dest);
     virtual void Decompress(ISequentialReadStream& source, ISequentialWriteStream& dest);
+    
+private:
+    const unsigned int m_dictionaryBits;
 };
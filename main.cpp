@@ -1,27 +1,88 @@
 #include "compressor.h"
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
 static void PrintUsage()
 {
-    std::cout << "Arguments list for compression  : -c <compressor> <file path source> <file path destination>" << std::endl;
+    std::cout << "Arguments list for compression  : [options] -c <compressor> <file path source> <file path destination>" << std::endl;
     std::cout << "Arguments list for decompression: -d <compressor> <file path source> <file path destination>" << std::endl;
-    std::cout << "<compressor> can be 'bitrle' or 'huffman'" << std::endl;
+    std::cout << "<compressor> can be 'bitrle', 'huffman', 'huffman4', 'fse', 'range', 'lzw', 'bitlzw', 'lz', 'lzh' or 'bwt'" << std::endl;
+    std::cout << "'-' as a file path stands for stdin or stdout" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  -b <KiB>  block size of 'bitrle', 'huffman', 'huffman4', 'fse', 'lz', 'lzh' and 'bwt', by default a file is one block" << std::endl;
+    std::cout << "            ('bwt' sorts blocks of 4096 KiB by default, 16383 KiB at most)" << std::endl;
+    std::cout << "  -l <bits> maximum code length of 'huffman' and 'huffman4', 8 to 32 (default 32)" << std::endl;
+    std::cout << "  -w <bits> dictionary size of 'bitlzw' in bits of a code, 12 to 20 (default 16)" << std::endl;
+    std::cout << "  -e <level> match finder of 'lz' and 'lzh': 1 fast, 2 greedy, 3 lazy (default 2 for 'lz', 3 for 'lzh')" << std::endl;
+    std::cout << "  -o <order> context order of 'range': 0 or 1 for the previous byte (default 0)" << std::endl;
+}
+
+static bool ParseSize(const char* arg, size_t* value)
+{
+    char* end = nullptr;
+    const unsigned long long v = strtoull(arg, &end, 10);
+    if (end == arg || 0 != *end)
+        return false;
+    *value = static_cast<size_t>(v);
+    return true;
 }
 
 int main(int argc, const char * argv[])
 {
-    if (argc != 5)
+    CompressorOptions options;
+    
+    int i = 1;
+    for (; i < argc && 0 != strcmp(argv[i], "-c") && 0 != strcmp(argv[i], "-d"); i += 2)
+    {
+        size_t value = 0;
+        if ((i + 1) >= argc || !ParseSize(argv[i + 1], &value))
+        {
+            PrintUsage();
+            return -1;
+        }
+        
+        if (0 == strcmp(argv[i], "-b") && 0 != value)
+        {
+            options.blockSize = value * 1024;
+        }
+        else if (0 == strcmp(argv[i], "-l") && 8 <= value && value <= 32)
+        {
+            options.maxCodeLength = static_cast<unsigned int>(value);
+        }
+        else if (0 == strcmp(argv[i], "-w") && 12 <= value && value <= 20)
+        {
+            options.dictionaryBits = static_cast<unsigned int>(value);
+        }
+        else if (0 == strcmp(argv[i], "-e") && 1 <= value && value <= 3)
+        {
+            options.level = static_cast<unsigned int>(value);
+        }
+        else if (0 == strcmp(argv[i], "-o") && value <= 1)
+        {
+            options.contextOrder = static_cast<unsigned int>(value);
+        }
+        else
+        {
+            PrintUsage();
+            return -1;
+        }
+    }
+    
+    if ((argc - i) != 4)
     {
         PrintUsage();
         return -1;
     }
-
+    
+    const char* const* args = argv + i;
+    
     bool compress = false;
-    if (0 == strcmp(argv[1], "-c"))
+    if (0 == strcmp(args[0], "-c"))
     {
         compress = true;
     }
-    else if (0 == strcmp(argv[1], "-d"))
+    else if (0 == strcmp(args[0], "-d"))
     {
         compress = false;
     }
@@ -37,20 +98,24 @@ int main(int argc, const char * argv[])
     {
         if (compress)
         {
-            Compress(argv[2], argv[3], argv[4]);
+            Compress(args[1], options, args[2], args[3]);
         }
         else
         {
-            Decompress(argv[2], argv[3], argv[4]);
+            Decompress(args[1], args[2], args[3]);
         }
         
         res = true;
         
-        std::cout << "Succeeded" << std::endl;
+        // stdout may carry the data
+        if (0 != strcmp(args[3], "-"))
+        {
+            std::cout << "Succeeded" << std::endl;
+        }
     }
     catch (std::exception& e)
     {
-        std::cout << "Exception: " << e.what() << std::endl;
+        std::cerr << "Exception: " << e.what() << std::endl;
     }
     
     return res ? 0 : -1;
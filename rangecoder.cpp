@@ -0,0 +1,158 @@
+#include "rangecoder.h"
+#include <algorithm>
+#include <cassert>
+
+//
+//
+//
+
+enum { RangeWindowSize = 1 << 16 };
+
+// bytes of the code read by Init, the first one is always 0
+enum { RangeInitBytes = 5 };
+
+//
+//
+//
+
+RangeEncoder::RangeEncoder(ISequentialWriteStream* stream)
+: m_low(0)
+, m_range(0xFFFFFFFFu)
+, m_cache(0)
+, m_cacheSize(1)
+, m_writer(stream, RangeWindowSize)
+, m_window(nullptr)
+, m_next(nullptr)
+, m_end(nullptr)
+{
+    assert(nullptr != stream);
+}
+
+void RangeEncoder::EncodeDirectBits(uint32_t value, unsigned int countBits)
+{
+    assert(countBits <= 32);
+    
+    while (countBits > 0)
+    {
+        --countBits;
+        m_range >>= 1;
+        if (0 != ((value >> countBits) & 1))
+            m_low += m_range;
+        
+        if (m_range < RangeTopValue)
+        {
+            m_range <<= 8;
+            ShiftLow();
+        }
+    }
+}
+
+void RangeEncoder::Flush()
+{
+    for (unsigned int i = 0; i < RangeInitBytes; ++i)
+    {
+        ShiftLow();
+    }
+    
+    if (nullptr != m_window)
+    {
+        m_writer.Commit(m_next - m_window);
+        m_window = m_next = m_end = nullptr;
+    }
+    m_writer.Flush();
+}
+
+void RangeEncoder::FlushWindow()
+{
+    if (nullptr != m_window)
+    {
+        m_writer.Commit(m_next - m_window);
+    }
+    
+    m_window = m_next = m_writer.Reserve(RangeWindowSize);
+    m_end = m_window + RangeWindowSize;
+}
+
+//
+//
+//
+
+RangeDecoder::RangeDecoder(ISequentialReadStream* stream)
+: m_code(0)
+, m_range(0xFFFFFFFFu)
+, m_padBytes(0)
+, m_reader(stream, RangeWindowSize)
+, m_window(nullptr)
+, m_next(nullptr)
+, m_end(nullptr)
+{
+    assert(nullptr != stream);
+}
+
+bool RangeDecoder::Init()
+{
+    if (0 != ReadByte())
+        return false;
+    
+    for (unsigned int i = 1; i < RangeInitBytes; ++i)
+    {
+        m_code = (m_code << 8) | ReadByte();
+    }
+    
+    // the code is below the range while the stream is one of the encoder
+    return !IsOverrun() && m_code < m_range;
+}
+
+uint32_t RangeDecoder::DecodeDirectBits(unsigned int countBits)
+{
+    assert(countBits <= 32);
+    
+    uint32_t value = 0;
+    while (countBits > 0)
+    {
+        --countBits;
+        m_range >>= 1;
+        
+        unsigned int bit = 0;
+        if (m_code >= m_range)
+        {
+            m_code -= m_range;
+            bit = 1;
+        }
+        value = (value << 1) | bit;
+        
+        if (m_range < RangeTopValue)
+            Normalize();
+    }
+    
+    return value;
+}
+
+unsigned char RangeDecoder::ReadByteSlow()
+{
+    assert(m_next == m_end);
+    
+    m_reader.Consume(m_end - m_window);
+    
+    size_t size = 0;
+    m_window = m_next = m_reader.Peek(&size);
+    m_end = m_next + size;
+    
+    if (0 == size)
+    {
+        // end of the stream, continue with zero bytes
+        m_window = m_next = m_end = nullptr;
+        ++m_padBytes;
+        return 0;
+    }
+    return *m_next++;
+}
+
+//
+//
+//
+
+RangeByteModel::RangeByteModel()
+{
+    std::fill(m_probs, m_probs + 256, static_cast<RangeProb>(RangeProbInit));
+}
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+#include "istream.h"
+#include "streamimpl.h"
+
+//
+// Binary range coder: a bit is coded with the probability of a zero, which adapts to the bits
+// coded with it. Probabilities are RangeProbBits-bit fixed point numbers.
+//
+
+enum { RangeProbBits = 11, RangeProbInit = 1 << (RangeProbBits - 1) };
+
+// a probability moves by 1 / 2^RangeAdaptShift of its distance to the coded bit
+enum { RangeAdaptShift = 5 };
+
+typedef uint16_t RangeProb;
+
+//
+//
+//
+
+class RangeEncoder
+{
+public:
+    // Bytes are put into a window of the stream, they reach it with Flush
+    RangeEncoder(ISequentialWriteStream* stream);
+    
+    void EncodeBit(RangeProb& prob, unsigned int bit);
+    
+    // Codes the countBits bits of value from the highest one down with a binary tree of probabilities:
+    // probs[1] is the root, the children of node m are 2m and 2m + 1
+    void EncodeTree(RangeProb* probs, unsigned int value, unsigned int countBits);
+    
+    // Bits with a fixed probability of 1/2, the highest of countBits bits first
+    void EncodeDirectBits(uint32_t value, unsigned int countBits);
+    
+    // Writes the rest of the code, the encoder can not be used after
+    void Flush();
+    
+private:
+    RangeEncoder(const RangeEncoder&);
+    RangeEncoder& operator=(const RangeEncoder&);
+    
+    void ShiftLow();
+    void WriteByte(unsigned char b);
+    void FlushWindow();
+    
+    uint64_t m_low;       // low end of the range, bit 32 is a carry into the cached bytes
+    uint32_t m_range;
+    unsigned char m_cache;  // last byte of the code not written yet, a carry may still change it
+    uint64_t m_cacheSize;   // m_cache and the 0xFF bytes after it
+    
+    ZeroCopyWriter m_writer;
+    unsigned char* m_window;
+    unsigned char* m_next;
+    unsigned char* m_end;
+};
+
+//
+//
+//
+
+class RangeDecoder
+{
+public:
+    // The decoder takes the stream's data ahead of the bits decoded,
+    // the stream must not be read directly while the decoder is in use.
+    RangeDecoder(ISequentialReadStream* stream);
+    
+    // Reads the first bytes of the code, false if they are not a code
+    bool Init();
+    
+    unsigned int DecodeBit(RangeProb& prob);
+    unsigned int DecodeTree(RangeProb* probs, unsigned int countBits);
+    uint32_t DecodeDirectBits(unsigned int countBits);
+    
+    // Tells whether the code needed bytes past the end of the stream
+    bool IsOverrun() const;
+    
+private:
+    RangeDecoder(const RangeDecoder&);
+    RangeDecoder& operator=(const RangeDecoder&);
+    
+    void Normalize();
+    unsigned char ReadByte();
+    unsigned char ReadByteSlow();
+    
+    uint32_t m_code;
+    uint32_t m_range;
+    unsigned int m_padBytes;  // zero bytes read past the end of the stream
+    
+    ZeroCopyReader m_reader;
+    const unsigned char* m_window;
+    const unsigned char* m_next;
+    const unsigned char* m_end;
+};
+
+//
+// Adaptive model of byte values: a byte is coded as 8 bits from the highest one down,
+// each with the probability of its prefix in a binary tree of 255 nodes.
+//
+
+class RangeByteModel
+{
+public:
+    RangeByteModel();
+    
+    void Encode(RangeEncoder& e, unsigned char b);
+    unsigned char Decode(RangeDecoder& d);
+    
+private:
+    RangeProb m_probs[256];  // tree of RangeEncoder::EncodeTree
+};
+
+//
+//
+//
+
+enum { RangeTopValue = 1 << 24 };
+
+// mask is all ones for a bit 1 and 0 for a bit 0, the bits of a model are hard to predict,
+// so both outcomes are computed and selected without branches
+inline RangeProb UpdateRangeProb(RangeProb prob, uint32_t mask)
+{
+    const uint32_t prob0 = prob + (((1 << RangeProbBits) - prob) >> RangeAdaptShift);
+    const uint32_t prob1 = prob - (prob >> RangeAdaptShift);
+    return static_cast<RangeProb>(prob0 ^ ((prob0 ^ prob1) & mask));
+}
+
+inline uint32_t SelectRange(uint32_t range, uint32_t bound, uint32_t mask)
+{
+    return bound ^ (((range - bound) ^ bound) & mask);
+}
+
+inline void RangeEncoder::EncodeBit(RangeProb& prob, unsigned int bit)
+{
+    assert(bit <= 1);
+    
+    const uint32_t bound = (m_range >> RangeProbBits) * prob;
+    const uint32_t mask = 0u - bit;
+    m_low += bound & mask;
+    m_range = SelectRange(m_range, bound, mask);
+    prob = UpdateRangeProb(prob, mask);
+    
+    if (m_range < RangeTopValue)
+    {
+        m_range <<= 8;
+        ShiftLow();
+    }
+}
+
+inline void RangeEncoder::EncodeTree(RangeProb* probs, unsigned int value, unsigned int countBits)
+{
+    // the state is kept in locals, the members are updated around ShiftLow only
+    uint64_t low = m_low;
+    uint32_t range = m_range;
+    
+    // the node of a bit is the bits above it with a leading 1
+    const unsigned int path = value | (1u << countBits);
+    while (countBits > 0)
+    {
+        --countBits;
+        const unsigned int m = path >> (countBits + 1);
+        const uint32_t mask = 0u - ((value >> countBits) & 1);
+        
+        const uint32_t bound = (range >> RangeProbBits) * probs[m];
+        low += bound & mask;
+        range = SelectRange(range, bound, mask);
+        probs[m] = UpdateRangeProb(probs[m], mask);
+        
+        if (range < RangeTopValue)
+        {
+            m_low = low;
+            ShiftLow();
+            low = m_low;
+            range <<= 8;
+        }
+    }
+    
+    m_low = low;
+    m_range = range;
+}
+
+inline void RangeEncoder::ShiftLow()
+{
+    // the top byte of m_low waits in m_cache while a carry can still reach it
+    if (static_cast<uint32_t>(m_low) < 0xFF000000u || 0 != (m_low >> 32))
+    {
+        const unsigned char carry = static_cast<unsigned char>(m_low >> 32);
+        unsigned char b = m_cache;
+        do
+        {
+            WriteByte(static_cast<unsigned char>(b + carry));
+            b = 0xFF;
+        }
+        while (0 != --m_cacheSize);
+        
+        m_cache = static_cast<unsigned char>(m_low >> 24);
+    }
+    
+    ++m_cacheSize;
+    m_low = (m_low & 0x00FFFFFF) << 8;
+}
+
+inline void RangeEncoder::WriteByte(unsigned char b)
+{
+    if (m_next == m_end)
+        FlushWindow();
+    *m_next++ = b;
+}
+
+inline unsigned int RangeDecoder::DecodeBit(RangeProb& prob)
+{
+    const uint32_t bound = (m_range >> RangeProbBits) * prob;
+    const unsigned int bit = (m_code >= bound) ? 1 : 0;
+    const uint32_t mask = 0u - bit;
+    m_code -= bound & mask;
+    m_range = SelectRange(m_range, bound, mask);
+    prob = UpdateRangeProb(prob, mask);
+    
+    if (m_range < RangeTopValue)
+        Normalize();
+    return bit;
+}
+
+inline unsigned int RangeDecoder::DecodeTree(RangeProb* probs, unsigned int countBits)
+{
+    // the state is kept in locals while the tree is decoded
+    uint32_t code = m_code;
+    uint32_t range = m_range;
+    
+    unsigned int m = 1;
+    for (unsigned int i = 0; i < countBits; ++i)
+    {
+        const uint32_t bound = (range >> RangeProbBits) * probs[m];
+        const unsigned int bit = (code >= bound) ? 1 : 0;
+        const uint32_t mask = 0u - bit;
+        
+        code -= bound & mask;
+        range = SelectRange(range, bound, mask);
+        probs[m] = UpdateRangeProb(probs[m], mask);
+        m = (m << 1) | bit;
+        
+        if (range < RangeTopValue)
+        {
+            range <<= 8;
+            code = (code << 8) | ReadByte();
+        }
+    }
+    
+    m_code = code;
+    m_range = range;
+    return m - (1u << countBits);
+}
+
+inline unsigned char RangeDecoder::ReadByte()
+{
+    return (m_next != m_end) ? *m_next++ : ReadByteSlow();
+}
+
+inline void RangeDecoder::Normalize()
+{
+    m_range <<= 8;
+    m_code = (m_code << 8) | ReadByte();
+}
+
+inline bool RangeDecoder::IsOverrun() const
+{
+    return 0 != m_padBytes;
+}
+
+inline void RangeByteModel::Encode(RangeEncoder& e, unsigned char b)
+{
+    e.EncodeTree(m_probs, b, 8);
+}
+
+inline unsigned char RangeByteModel::Decode(RangeDecoder& d)
+{
+    return static_cast<unsigned char>(d.DecodeTree(m_probs, 8));
+}
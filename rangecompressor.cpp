@@ -0,0 +1,116 @@
+#include "rangecompressor.h"
+#include "rangecoder.h"
+#include "streamimpl.h"
+#include "format.h"
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+enum { RangeFormatVersion = 2 };
+
+enum { RangeMaxOrder = 1 };
+
+// data is coded in chunks that follow their size, sizes take RangeChunkSizeBits direct bits
+enum { RangeChunkSize = 1 << 16, RangeChunkSizeBits = 17 };
+
+inline void check_true(bool expr)
+{
+    if (!expr) throw std::exception();
+}
+
+// models of the order, a byte is coded with the one of its previous bytes masked by the returned value
+static unsigned int MakeRangeModels(unsigned int order, std::vector<RangeByteModel>& models)
+{
+    assert(order <= RangeMaxOrder);
+    
+    models.assign((0 == order) ? 1 : 256, RangeByteModel());
+    return (0 == order) ? 0 : 0xFF;
+}
+
+//
+//
+//
+
+Range::Range(const CompressorOptions& options)
+: m_order(options.contextOrder)
+{
+}
+
+// Stream: the order byte, then a range code of chunks, each is its size and bytes, a zero size ends the stream
+void Range::Compress(IReadStream& source, ISequentialWriteStream& dest)
+{
+    check_true( m_order <= RangeMaxOrder );
+    
+    WriteFormatHeader(dest, RangeFormatVersion);
+    
+    const unsigned char order = static_cast<unsigned char>(m_order);
+    check_true( dest.Write(&order, sizeof(order)) == sizeof(order) );
+    
+    std::vector<RangeByteModel> models;
+    const unsigned int mask = MakeRangeModels(order, models);
+    
+    RangeEncoder e(&dest);
+    unsigned int prev = 0;
+    
+    ForEachSpan(source, [&](const unsigned char* data, size_t n)
+    {
+        while (n > 0)
+        {
+            const size_t size = std::min(n, static_cast<size_t>(RangeChunkSize));
+            e.EncodeDirectBits(static_cast<uint32_t>(size), RangeChunkSizeBits);
+            
+            for (size_t i = 0; i < size; ++i)
+            {
+                models[prev & mask].Encode(e, data[i]);
+                prev = data[i];
+            }
+            
+            data += size;
+            n -= size;
+        }
+    });
+    
+    e.EncodeDirectBits(0, RangeChunkSizeBits);
+    e.Flush();
+}
+
+void Range::Decompress(ISequentialReadStream& source, ISequentialWriteStream& dest)
+{
+    unsigned char version = 0;
+    uint32_t head = 0;
+    check_true( ReadFormatHeader(source, &version, &head) );
+    check_true( RangeFormatVersion == version );
+    
+    unsigned char order = 0;
+    check_true( source.Read(&order, sizeof(order)) == sizeof(order) );
+    check_true( order <= RangeMaxOrder );
+    
+    std::vector<RangeByteModel> models;
+    const unsigned int mask = MakeRangeModels(order, models);
+    
+    RangeDecoder d(&source);
+    check_true( d.Init() );
+    
+    ZeroCopyWriter writer(&dest);
+    unsigned int prev = 0;
+    
+    for (;;)
+    {
+        const size_t size = d.DecodeDirectBits(RangeChunkSizeBits);
+        check_true( !d.IsOverrun() );
+        if (0 == size)
+            break;
+        
+        check_true( size <= RangeChunkSize );
+        
+        unsigned char* out = writer.Reserve(size);
+        for (size_t i = 0; i < size; ++i)
+        {
+            out[i] = models[prev & mask].Decode(d);
+            prev = out[i];
+        }
+        writer.Commit(size);
+    }
+    
+    writer.Flush();
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "icompressor.h"
+
+class Range : public ICompressor
+{
+public:
+    // Models adapt while a source is coded in a single pass, contextOrder of the options selects
+    // a model for all bytes (0) or a model per previous byte (1)
+    Range(const CompressorOptions& options = CompressorOptions());
+    
+    virtual void Compress(IReadStream& source, ISequentialWriteStream& dest);
+    virtual void Decompress(ISequentialReadStream& source, ISequentialWriteStream& dest);
+    
+private:
+    const unsigned int m_order;
+};
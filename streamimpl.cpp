@@ -1,6 +1,10 @@
 #include "streamimpl.h"
 #include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <exception>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 //
 //
@@ -8,11 +12,12 @@
 
 ByteArraySequentialWriteStream::ByteArraySequentialWriteStream(std::vector<unsigned char>* buff)
 : m_buff(buff)
+, m_reserved(0)
 {
     assert(nullptr != buff);
 }
 
-unsigned int ByteArraySequentialWriteStream::Write(const void* data, unsigned int size)
+size_t ByteArraySequentialWriteStream::Write(const void* data, size_t size)
 {
     assert(nullptr != data);
     
@@ -21,6 +26,21 @@ unsigned int ByteArraySequentialWriteStream::Write(const void* data, unsigned in
     return size;
 }
 
+unsigned char* ByteArraySequentialWriteStream::Reserve(size_t size)
+{
+    m_reserved = m_buff->size();
+    m_buff->resize(m_reserved + size);
+    return m_buff->data() + m_reserved;
+}
+
+void ByteArraySequentialWriteStream::Commit(size_t size)
+{
+    assert(m_reserved + size <= m_buff->size());
+    
+    m_buff->resize(m_reserved + size);
+    m_reserved = m_buff->size();
+}
+
 //
 //
 //
@@ -32,7 +52,7 @@ ByteArrayReadStream::ByteArrayReadStream(std::vector<unsigned char>* buff)
     assert(nullptr != buff);
 }
 
-unsigned int ByteArrayReadStream::Read(void* data, unsigned int size)
+size_t ByteArrayReadStream::Read(void* data, size_t size)
 {
     assert(nullptr != data);
     
@@ -40,7 +60,7 @@ unsigned int ByteArrayReadStream::Read(void* data, unsigned int size)
         return 0;
     
     if ((m_buff->size() - m_index) < size)
-        size = static_cast<unsigned int>(m_buff->size() - m_index);
+        size = m_buff->size() - m_index;
     
     unsigned char* b = reinterpret_cast<unsigned char*>(data);
     std::copy(m_buff->begin() + m_index, m_buff->begin() + m_index + size, b);
@@ -48,19 +68,40 @@ unsigned int ByteArrayReadStream::Read(void* data, unsigned int size)
     return size;
 }
 
-unsigned int ByteArrayReadStream::GetPos()
+uint64_t ByteArrayReadStream::GetPos()
 {
     return m_index;
 }
 
-bool ByteArrayReadStream::Seek(unsigned int pos)
+bool ByteArrayReadStream::Seek(uint64_t pos)
 {
     if (pos >= m_buff->size())
         return false;
-    m_index = pos;
+    m_index = static_cast<size_t>(pos);
     return true;
 }
 
+const unsigned char* ByteArrayReadStream::Peek(size_t* size)
+{
+    assert(nullptr != size);
+    
+    if (m_index >= m_buff->size())
+    {
+        *size = 0;
+        return nullptr;
+    }
+    
+    *size = m_buff->size() - m_index;
+    return m_buff->data() + m_index;
+}
+
+void ByteArrayReadStream::Consume(size_t size)
+{
+    assert(m_index + size <= m_buff->size());
+    
+    m_index += size;
+}
+
 //
 //
 //
@@ -71,7 +112,7 @@ FileSequentialWriteStream::FileSequentialWriteStream(FILE* file)
     assert(nullptr != m_file);
 }
 
-unsigned int FileSequentialWriteStream::Write(const void* data, unsigned int size)
+size_t FileSequentialWriteStream::Write(const void* data, size_t size)
 {
     assert(nullptr != data);
     
@@ -82,7 +123,7 @@ unsigned int FileSequentialWriteStream::Write(const void* data, unsigned int siz
         throw std::exception();
     }
     
-    return static_cast<unsigned int>(res);
+    return res;
 }
 
 //
@@ -95,7 +136,7 @@ FileReadStream::FileReadStream(FILE* file)
     assert(nullptr != file);
 }
 
-unsigned int FileReadStream::Read(void* data, unsigned int size)
+size_t FileReadStream::Read(void* data, size_t size)
 {
     assert(nullptr != data);
     
@@ -106,22 +147,404 @@ unsigned int FileReadStream::Read(void* data, unsigned int size)
         throw std::exception();
     }
     
-    return static_cast<unsigned int>(res);
+    return res;
 }
 
-unsigned int FileReadStream::GetPos()
+uint64_t FileReadStream::GetPos()
 {
-    const long pos = ftell(m_file);
+    const off_t pos = ftello(m_file);
     
     if (pos < 0)
     {
         throw std::exception();
     }
     
-    return static_cast<unsigned int>(pos);
+    return static_cast<uint64_t>(pos);
+}
+
+bool FileReadStream::Seek(uint64_t pos)
+{
+    return (0 == fseeko(m_file, static_cast<off_t>(pos), SEEK_SET));
+}
+
+//
+//
+//
+
+BufferedFileSequentialWriteStream::BufferedFileSequentialWriteStream(FILE* file, size_t bufferSize)
+: m_file(file)
+, m_buffer(bufferSize)
+, m_size(0)
+{
+    assert(nullptr != file);
+    assert(0 != bufferSize);
+}
+
+BufferedFileSequentialWriteStream::~BufferedFileSequentialWriteStream()
+{
+    // Errors can not be reported from here, call Flush to get them
+    if (0 != m_size)
+    {
+        fwrite(&m_buffer[0], 1, m_size, m_file);
+    }
+}
+
+size_t BufferedFileSequentialWriteStream::Write(const void* data, size_t size)
+{
+    assert(nullptr != data);
+    
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(data);
+    const size_t capacity = m_buffer.size();
+    
+    if (size > (capacity - m_size))
+    {
+        Flush();
+        
+        if (size >= capacity)
+        {
+            WriteFile(b, size);
+            return size;
+        }
+    }
+    
+    memcpy(&m_buffer[m_size], b, size);
+    m_size += size;
+    return size;
+}
+
+unsigned char* BufferedFileSequentialWriteStream::Reserve(size_t size)
+{
+    if (size > (m_buffer.size() - m_size))
+    {
+        Flush();
+        
+        if (size > m_buffer.size())
+        {
+            m_buffer.resize(size);
+        }
+    }
+    
+    return m_buffer.data() + m_size;
+}
+
+void BufferedFileSequentialWriteStream::Commit(size_t size)
+{
+    assert(m_size + size <= m_buffer.size());
+    
+    m_size += size;
+}
+
+void BufferedFileSequentialWriteStream::Flush()
+{
+    if (0 != m_size)
+    {
+        WriteFile(&m_buffer[0], m_size);
+        m_size = 0;
+    }
+}
+
+void BufferedFileSequentialWriteStream::WriteFile(const void* data, size_t size)
+{
+    if (fwrite(data, 1, size, m_file) != size)
+    {
+        throw std::exception();
+    }
+}
+
+//
+//
+//
+
+BufferedFileReadStream::BufferedFileReadStream(FILE* file, size_t bufferSize)
+: m_file(file)
+, m_seekable(0 == fseeko(file, 0, SEEK_CUR))
+, m_buffer(bufferSize)
+, m_bufferPos(0)
+, m_size(0)
+, m_index(0)
+{
+    assert(nullptr != file);
+    assert(0 != bufferSize);
+    
+    const off_t pos = ftello(m_file);
+    if (pos > 0)
+    {
+        m_bufferPos = static_cast<uint64_t>(pos);
+    }
+}
+
+size_t BufferedFileReadStream::Read(void* data, size_t size)
+{
+    assert(nullptr != data);
+    
+    unsigned char* b = reinterpret_cast<unsigned char*>(data);
+    size_t res = 0;
+    
+    while (res < size)
+    {
+        if (m_index == m_size)
+        {
+            const size_t capacity = m_buffer.size();
+            
+            m_bufferPos += m_size;
+            m_index = m_size = 0;
+            
+            // large requests bypass the buffer
+            if ((size - res) >= capacity)
+            {
+                const size_t n = ReadFile(b + res, size - res);
+                m_bufferPos += n;
+                return res + n;
+            }
+            
+            m_size = ReadFile(&m_buffer[0], capacity);
+            if (0 == m_size)
+                break;
+        }
+        
+        const size_t n = std::min(size - res, m_size - m_index);
+        memcpy(b + res, &m_buffer[m_index], n);
+        m_index += n;
+        res += n;
+    }
+    
+    return res;
+}
+
+uint64_t BufferedFileReadStream::GetPos()
+{
+    return m_bufferPos + m_index;
+}
+
+bool BufferedFileReadStream::Seek(uint64_t pos)
+{
+    // pipes can not go back even inside of the buffer, codecs rely on this to detect them
+    if (!m_seekable)
+        return false;
+    
+    if (pos >= m_bufferPos && pos <= (m_bufferPos + m_size))
+    {
+        m_index = static_cast<size_t>(pos - m_bufferPos);
+        return true;
+    }
+    
+    if (0 != fseeko(m_file, static_cast<off_t>(pos), SEEK_SET))
+        return false;
+    
+    m_bufferPos = pos;
+    m_index = m_size = 0;
+    return true;
+}
+
+const unsigned char* BufferedFileReadStream::Peek(size_t* size)
+{
+    assert(nullptr != size);
+    
+    if (m_index == m_size)
+    {
+        m_bufferPos += m_size;
+        m_index = 0;
+        m_size = ReadFile(m_buffer.data(), m_buffer.size());
+    }
+    
+    *size = m_size - m_index;
+    return m_buffer.data() + m_index;
+}
+
+void BufferedFileReadStream::Consume(size_t size)
+{
+    assert(m_index + size <= m_size);
+    
+    m_index += size;
+}
+
+size_t BufferedFileReadStream::ReadFile(void* data, size_t size)
+{
+    const size_t res = fread(data, 1, size, m_file);
+    
+    if (res != size && 0 != ferror(m_file))
+    {
+        throw std::exception();
+    }
+    
+    return res;
+}
+
+//
+//
+//
+
+MmapReadStream::MmapReadStream(FILE* file)
+: m_data(nullptr)
+, m_size(0)
+, m_index(0)
+{
+    assert(nullptr != file);
+    
+    const int fd = fileno(file);
+    
+    struct stat st;
+    if (0 != fstat(fd, &st) || !S_ISREG(st.st_mode) || 0 == st.st_size)
+    {
+        throw std::exception();
+    }
+    
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == data)
+    {
+        throw std::exception();
+    }
+    
+    // advice is only a hint, failure is not an error
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    
+    m_data = reinterpret_cast<const unsigned char*>(data);
+    m_size = static_cast<size_t>(st.st_size);
+}
+
+MmapReadStream::~MmapReadStream()
+{
+    munmap(const_cast<unsigned char*>(m_data), m_size);
+}
+
+size_t MmapReadStream::Read(void* data, size_t size)
+{
+    assert(nullptr != data);
+    
+    if ((m_size - m_index) < size)
+        size = m_size - m_index;
+    
+    memcpy(data, m_data + m_index, size);
+    m_index += size;
+    return size;
+}
+
+uint64_t MmapReadStream::GetPos()
+{
+    return m_index;
+}
+
+bool MmapReadStream::Seek(uint64_t pos)
+{
+    if (pos > m_size)
+        return false;
+    m_index = static_cast<size_t>(pos);
+    return true;
+}
+
+const unsigned char* MmapReadStream::Peek(size_t* size)
+{
+    assert(nullptr != size);
+    
+    *size = m_size - m_index;
+    return m_data + m_index;
+}
+
+void MmapReadStream::Consume(size_t size)
+{
+    assert(m_index + size <= m_size);
+    
+    m_index += size;
+}
+
+//
+//
+//
+
+ZeroCopyReader::ZeroCopyReader(ISequentialReadStream* stream, size_t bufferSize)
+: m_stream(stream)
+, m_zeroCopy(dynamic_cast<IZeroCopyReadStream*>(stream))
+, m_buffer(nullptr != m_zeroCopy ? 0 : bufferSize)
+, m_size(0)
+, m_index(0)
+{
+    assert(nullptr != stream);
+    assert(0 != bufferSize);
+}
+
+const unsigned char* ZeroCopyReader::Peek(size_t* size)
+{
+    assert(nullptr != size);
+    
+    if (nullptr != m_zeroCopy)
+        return m_zeroCopy->Peek(size);
+    
+    if (m_index == m_size)
+    {
+        m_index = 0;
+        m_size = m_stream->Read(m_buffer.data(), m_buffer.size());
+    }
+    
+    *size = m_size - m_index;
+    return m_buffer.data() + m_index;
+}
+
+void ZeroCopyReader::Consume(size_t size)
+{
+    if (nullptr != m_zeroCopy)
+    {
+        m_zeroCopy->Consume(size);
+        return;
+    }
+    
+    assert(m_index + size <= m_size);
+    
+    m_index += size;
+}
+
+//
+//
+//
+
+ZeroCopyWriter::ZeroCopyWriter(ISequentialWriteStream* stream, size_t bufferSize)
+: m_stream(stream)
+, m_zeroCopy(dynamic_cast<IZeroCopyWriteStream*>(stream))
+, m_buffer(nullptr != m_zeroCopy ? 0 : bufferSize)
+, m_size(0)
+{
+    assert(nullptr != stream);
+    assert(0 != bufferSize);
+}
+
+unsigned char* ZeroCopyWriter::Reserve(size_t size)
+{
+    if (nullptr != m_zeroCopy)
+        return m_zeroCopy->Reserve(size);
+    
+    if (size > (m_buffer.size() - m_size))
+    {
+        Flush();
+        
+        if (size > m_buffer.size())
+        {
+            m_buffer.resize(size);
+        }
+    }
+    
+    return m_buffer.data() + m_size;
+}
+
+void ZeroCopyWriter::Commit(size_t size)
+{
+    if (nullptr != m_zeroCopy)
+    {
+        m_zeroCopy->Commit(size);
+        return;
+    }
+    
+    assert(m_size + size <= m_buffer.size());
+    
+    m_size += size;
 }
 
-bool FileReadStream::Seek(unsigned int pos)
+void ZeroCopyWriter::Flush()
 {
-    return (0 == fseek(m_file, pos, SEEK_SET));
+    if (0 != m_size)
+    {
+        if (m_stream->Write(m_buffer.data(), m_size) != m_size)
+        {
+            throw std::exception();
+        }
+        m_size = 0;
+    }
 }
@@ -1,45 +1,60 @@
 #pragma once
 
 #include "istream.h"
+#include <algorithm>
+#include <cstdio>
 #include <vector>
 
 //
 //
 //
 
-class ByteArraySequentialWriteStream : public ISequentialWriteStream
+enum { DefaultStreamBufferSize = 1 << 20 };
+
+//
+//
+//
+
+class ByteArraySequentialWriteStream : public ISequentialWriteStream, public IZeroCopyWriteStream
 {
 public:
     ByteArraySequentialWriteStream(std::vector<unsigned char>* buff);
     
-    virtual unsigned int Write(const void* data, unsigned int size);
+    virtual size_t Write(const void* data, size_t size);
+    
+    virtual unsigned char* Reserve(size_t size);
+    virtual void Commit(size_t size);
     
 private:
     ByteArraySequentialWriteStream(const ByteArraySequentialWriteStream&);
     ByteArraySequentialWriteStream& operator=(const ByteArraySequentialWriteStream&);
     
     std::vector<unsigned char>* const m_buff;
+    size_t m_reserved; // size of m_buff before the last Reserve
 };
 
 //
 //
 //
 
-class ByteArrayReadStream : public IReadStream
+class ByteArrayReadStream : public IReadStream, public IZeroCopyReadStream
 {
 public:
     ByteArrayReadStream(std::vector<unsigned char>* buff);
     
-    virtual unsigned int Read(void* data, unsigned int size);
-    virtual unsigned int GetPos();
-    virtual bool Seek(unsigned int pos);
-
+    virtual size_t Read(void* data, size_t size);
+    virtual uint64_t GetPos();
+    virtual bool Seek(uint64_t pos);
+    
+    virtual const unsigned char* Peek(size_t* size);
+    virtual void Consume(size_t size);
+    
 private:
     ByteArrayReadStream(const ByteArrayReadStream&);
     ByteArrayReadStream& operator=(const ByteArrayReadStream&);
     
     std::vector<unsigned char>* const m_buff;
-    unsigned int m_index;
+    size_t m_index;
 };
 
 //
@@ -51,7 +66,7 @@ class FileSequentialWriteStream : public ISequentialWriteStream
 public:
     FileSequentialWriteStream(FILE* file);
     
-    virtual unsigned int Write(const void* data, unsigned int size);
+    virtual size_t Write(const void* data, size_t size);
     
 private:
     FileSequentialWriteStream(const FileSequentialWriteStream&);
@@ -69,9 +84,9 @@ class FileReadStream : public IReadStream
 public:
     FileReadStream(FILE* file);
     
-    virtual unsigned int Read(void* data, unsigned int size);
-    virtual unsigned int GetPos();
-    virtual bool Seek(unsigned int pos);
+    virtual size_t Read(void* data, size_t size);
+    virtual uint64_t GetPos();
+    virtual bool Seek(uint64_t pos);
     
 private:
     FileReadStream(const FileReadStream&);
@@ -79,3 +94,192 @@ private:
     
     FILE* const m_file;
 };
+
+//
+//
+//
+
+class BufferedFileSequentialWriteStream : public ISequentialWriteStream, public IZeroCopyWriteStream
+{
+public:
+    BufferedFileSequentialWriteStream(FILE* file, size_t bufferSize = DefaultStreamBufferSize);
+    ~BufferedFileSequentialWriteStream();
+    
+    virtual size_t Write(const void* data, size_t size);
+    
+    // Reserve grows the buffer if size exceeds it
+    virtual unsigned char* Reserve(size_t size);
+    virtual void Commit(size_t size);
+    
+    void Flush();
+    
+private:
+    BufferedFileSequentialWriteStream(const BufferedFileSequentialWriteStream&);
+    BufferedFileSequentialWriteStream& operator=(const BufferedFileSequentialWriteStream&);
+    
+    void WriteFile(const void* data, size_t size);
+    
+    FILE* const m_file;
+    std::vector<unsigned char> m_buffer;
+    size_t m_size;
+};
+
+//
+//
+//
+
+class BufferedFileReadStream : public IReadStream, public IZeroCopyReadStream
+{
+public:
+    BufferedFileReadStream(FILE* file, size_t bufferSize = DefaultStreamBufferSize);
+    
+    virtual size_t Read(void* data, size_t size);
+    virtual uint64_t GetPos();
+    virtual bool Seek(uint64_t pos);
+    
+    virtual const unsigned char* Peek(size_t* size);
+    virtual void Consume(size_t size);
+    
+private:
+    BufferedFileReadStream(const BufferedFileReadStream&);
+    BufferedFileReadStream& operator=(const BufferedFileReadStream&);
+    
+    size_t ReadFile(void* data, size_t size);
+    
+    FILE* const m_file;
+    bool m_seekable;
+    std::vector<unsigned char> m_buffer;
+    uint64_t m_bufferPos; // file position of m_buffer[0]
+    size_t m_size;
+    size_t m_index;
+};
+
+//
+//
+//
+
+class MmapReadStream : public IReadStream, public IZeroCopyReadStream
+{
+public:
+    // file must be a non-empty regular file
+    MmapReadStream(FILE* file);
+    ~MmapReadStream();
+    
+    virtual size_t Read(void* data, size_t size);
+    virtual uint64_t GetPos();
+    virtual bool Seek(uint64_t pos);
+    
+    // the window is the whole rest of the mapping
+    virtual const unsigned char* Peek(size_t* size);
+    virtual void Consume(size_t size);
+    
+private:
+    MmapReadStream(const MmapReadStream&);
+    MmapReadStream& operator=(const MmapReadStream&);
+    
+    const unsigned char* m_data;
+    size_t m_size;
+    size_t m_index;
+};
+
+//
+// Zero-copy reading from any sequential stream: the stream's own window is borrowed
+// when it implements IZeroCopyReadStream, otherwise data goes through a local buffer.
+//
+
+class ZeroCopyReader : public IZeroCopyReadStream
+{
+public:
+    ZeroCopyReader(ISequentialReadStream* stream, size_t bufferSize = DefaultStreamBufferSize);
+    
+    virtual const unsigned char* Peek(size_t* size);
+    virtual void Consume(size_t size);
+    
+private:
+    ZeroCopyReader(const ZeroCopyReader&);
+    ZeroCopyReader& operator=(const ZeroCopyReader&);
+    
+    ISequentialReadStream* const m_stream;
+    IZeroCopyReadStream* const m_zeroCopy;
+    std::vector<unsigned char> m_buffer;
+    size_t m_size;
+    size_t m_index;
+};
+
+//
+// Zero-copy writing to any sequential stream: windows are reserved in the stream itself
+// when it implements IZeroCopyWriteStream, otherwise in a local buffer written out by Flush.
+//
+
+class ZeroCopyWriter : public IZeroCopyWriteStream
+{
+public:
+    ZeroCopyWriter(ISequentialWriteStream* stream, size_t bufferSize = DefaultStreamBufferSize);
+    
+    virtual unsigned char* Reserve(size_t size);
+    virtual void Commit(size_t size);
+    
+    void Flush();
+    
+private:
+    ZeroCopyWriter(const ZeroCopyWriter&);
+    ZeroCopyWriter& operator=(const ZeroCopyWriter&);
+    
+    ISequentialWriteStream* const m_stream;
+    IZeroCopyWriteStream* const m_zeroCopy;
+    std::vector<unsigned char> m_buffer;
+    size_t m_size;
+};
+
+//
+//
+//
+
+// Calls f(const unsigned char* data, size_t size) for consecutive windows until the end of source
+template <typename F>
+void ForEachSpan(ISequentialReadStream& source, F f)
+{
+    ZeroCopyReader reader(&source);
+    size_t n = 0;
+    for (const unsigned char* data = reader.Peek(&n); 0 != n; data = reader.Peek(&n))
+    {
+        f(data, n);
+        reader.Consume(n);
+    }
+}
+
+// Calls f(const unsigned char* data, size_t size) for consecutive blocks of blockSize bytes until the end
+// of source, only the last block may be shorter. Blocks are borrowed from the source window when it holds
+// a whole block and are collected in a local buffer otherwise.
+template <typename F>
+void ForEachBlock(ISequentialReadStream& source, size_t blockSize, F f)
+{
+    ZeroCopyReader reader(&source);
+    std::vector<unsigned char> block;
+    size_t n = 0;
+    for (const unsigned char* data = reader.Peek(&n); 0 != n; data = reader.Peek(&n))
+    {
+        if (block.empty() && n >= blockSize)
+        {
+            f(data, blockSize);
+            reader.Consume(blockSize);
+            continue;
+        }
+        
+        if (block.empty())
+            block.reserve(blockSize);
+        
+        const size_t size = std::min(n, blockSize - block.size());
+        block.insert(block.end(), data, data + size);
+        reader.Consume(size);
+        
+        if (block.size() == blockSize)
+        {
+            f(block.data(), block.size());
+            block.clear();
+        }
+    }
+    
+    if (!block.empty())
+        f(block.data(), block.size());
+}